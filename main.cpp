@@ -3,310 +3,6032 @@
 #include <sstream>
 #include <string>
 #include <list>
+#include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <algorithm>
 #include <vector>
 #include <cstdlib>
 #include <ctime>
 #include <chrono>
 #include <random>
+#include <iomanip>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <numeric>
+#include <memory_resource>
+#include <memory>
+#include <thread>
+#include <future>
+#include <stdexcept>
+#include <limits>
+#include <span>
+#include <string_view>
+#include <bit>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <charconv>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifdef __PCLMUL__
+#include <wmmintrin.h>
+#endif
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#include <io.h>
+#include <fcntl.h>
+#include <xmmintrin.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 using namespace std;
 using namespace std::chrono;
 
-string toLower(const string &s) {
-    string result = s;
-    transform(result.begin(), result.end(), result.begin(), ::tolower);
+// Unicode simple case folding (the C and S entries of CaseFolding.txt, Unicode 14) as runs of
+// code points sharing one offset. Stride 2 runs cover the alternating upper/lower pairs of the
+// Latin, Greek and Cyrillic extension blocks. Sorted by first code point, non-overlapping.
+struct CaseFoldRun {
+    uint32_t first;
+    int32_t delta;
+    uint8_t count;
+    uint8_t stride;
+};
+
+constexpr CaseFoldRun caseFoldRuns[] = {
+    {0xB5, 775, 1, 1}, {0xC0, 32, 23, 1}, {0xD8, 32, 7, 1}, {0x100, 1, 24, 2}, {0x132, 1, 3, 2},
+    {0x139, 1, 8, 2}, {0x14A, 1, 23, 2}, {0x178, -121, 1, 1}, {0x179, 1, 3, 2},
+    {0x17F, -268, 1, 1}, {0x181, 210, 1, 1}, {0x182, 1, 2, 2}, {0x186, 206, 1, 1},
+    {0x187, 1, 1, 1}, {0x189, 205, 2, 1}, {0x18B, 1, 1, 1}, {0x18E, 79, 1, 1}, {0x18F, 202, 1, 1},
+    {0x190, 203, 1, 1}, {0x191, 1, 1, 1}, {0x193, 205, 1, 1}, {0x194, 207, 1, 1},
+    {0x196, 211, 1, 1}, {0x197, 209, 1, 1}, {0x198, 1, 1, 1}, {0x19C, 211, 1, 1},
+    {0x19D, 213, 1, 1}, {0x19F, 214, 1, 1}, {0x1A0, 1, 3, 2}, {0x1A6, 218, 1, 1}, {0x1A7, 1, 1, 1},
+    {0x1A9, 218, 1, 1}, {0x1AC, 1, 1, 1}, {0x1AE, 218, 1, 1}, {0x1AF, 1, 1, 1}, {0x1B1, 217, 2, 1},
+    {0x1B3, 1, 2, 2}, {0x1B7, 219, 1, 1}, {0x1B8, 1, 1, 1}, {0x1BC, 1, 1, 1}, {0x1C4, 2, 1, 1},
+    {0x1C5, 1, 1, 1}, {0x1C7, 2, 1, 1}, {0x1C8, 1, 1, 1}, {0x1CA, 2, 1, 1}, {0x1CB, 1, 9, 2},
+    {0x1DE, 1, 9, 2}, {0x1F1, 2, 1, 1}, {0x1F2, 1, 2, 2}, {0x1F6, -97, 1, 1}, {0x1F7, -56, 1, 1},
+    {0x1F8, 1, 20, 2}, {0x220, -130, 1, 1}, {0x222, 1, 9, 2}, {0x23A, 10795, 1, 1},
+    {0x23B, 1, 1, 1}, {0x23D, -163, 1, 1}, {0x23E, 10792, 1, 1}, {0x241, 1, 1, 1},
+    {0x243, -195, 1, 1}, {0x244, 69, 1, 1}, {0x245, 71, 1, 1}, {0x246, 1, 5, 2},
+    {0x345, 116, 1, 1}, {0x370, 1, 2, 2}, {0x376, 1, 1, 1}, {0x37F, 116, 1, 1}, {0x386, 38, 1, 1},
+    {0x388, 37, 3, 1}, {0x38C, 64, 1, 1}, {0x38E, 63, 2, 1}, {0x391, 32, 17, 1}, {0x3A3, 32, 9, 1},
+    {0x3C2, 1, 1, 1}, {0x3CF, 8, 1, 1}, {0x3D0, -30, 1, 1}, {0x3D1, -25, 1, 1}, {0x3D5, -15, 1, 1},
+    {0x3D6, -22, 1, 1}, {0x3D8, 1, 12, 2}, {0x3F0, -54, 1, 1}, {0x3F1, -48, 1, 1},
+    {0x3F4, -60, 1, 1}, {0x3F5, -64, 1, 1}, {0x3F7, 1, 1, 1}, {0x3F9, -7, 1, 1}, {0x3FA, 1, 1, 1},
+    {0x3FD, -130, 3, 1}, {0x400, 80, 16, 1}, {0x410, 32, 32, 1}, {0x460, 1, 17, 2},
+    {0x48A, 1, 27, 2}, {0x4C0, 15, 1, 1}, {0x4C1, 1, 7, 2}, {0x4D0, 1, 48, 2}, {0x531, 48, 38, 1},
+    {0x10A0, 7264, 38, 1}, {0x10C7, 7264, 1, 1}, {0x10CD, 7264, 1, 1}, {0x13F8, -8, 6, 1},
+    {0x1C80, -6222, 1, 1}, {0x1C81, -6221, 1, 1}, {0x1C82, -6212, 1, 1}, {0x1C83, -6210, 2, 1},
+    {0x1C85, -6211, 1, 1}, {0x1C86, -6204, 1, 1}, {0x1C87, -6180, 1, 1}, {0x1C88, 35267, 1, 1},
+    {0x1C90, -3008, 43, 1}, {0x1CBD, -3008, 3, 1}, {0x1E00, 1, 75, 2}, {0x1E9B, -58, 1, 1},
+    {0x1E9E, -7615, 1, 1}, {0x1EA0, 1, 48, 2}, {0x1F08, -8, 8, 1}, {0x1F18, -8, 6, 1},
+    {0x1F28, -8, 8, 1}, {0x1F38, -8, 8, 1}, {0x1F48, -8, 6, 1}, {0x1F59, -8, 4, 2},
+    {0x1F68, -8, 8, 1}, {0x1F88, -8, 8, 1}, {0x1F98, -8, 8, 1}, {0x1FA8, -8, 8, 1},
+    {0x1FB8, -8, 2, 1}, {0x1FBA, -74, 2, 1}, {0x1FBC, -9, 1, 1}, {0x1FBE, -7173, 1, 1},
+    {0x1FC8, -86, 4, 1}, {0x1FCC, -9, 1, 1}, {0x1FD8, -8, 2, 1}, {0x1FDA, -100, 2, 1},
+    {0x1FE8, -8, 2, 1}, {0x1FEA, -112, 2, 1}, {0x1FEC, -7, 1, 1}, {0x1FF8, -128, 2, 1},
+    {0x1FFA, -126, 2, 1}, {0x1FFC, -9, 1, 1}, {0x2126, -7517, 1, 1}, {0x212A, -8383, 1, 1},
+    {0x212B, -8262, 1, 1}, {0x2132, 28, 1, 1}, {0x2160, 16, 16, 1}, {0x2183, 1, 1, 1},
+    {0x24B6, 26, 26, 1}, {0x2C00, 48, 48, 1}, {0x2C60, 1, 1, 1}, {0x2C62, -10743, 1, 1},
+    {0x2C63, -3814, 1, 1}, {0x2C64, -10727, 1, 1}, {0x2C67, 1, 3, 2}, {0x2C6D, -10780, 1, 1},
+    {0x2C6E, -10749, 1, 1}, {0x2C6F, -10783, 1, 1}, {0x2C70, -10782, 1, 1}, {0x2C72, 1, 1, 1},
+    {0x2C75, 1, 1, 1}, {0x2C7E, -10815, 2, 1}, {0x2C80, 1, 50, 2}, {0x2CEB, 1, 2, 2},
+    {0x2CF2, 1, 1, 1}, {0xA640, 1, 23, 2}, {0xA680, 1, 14, 2}, {0xA722, 1, 7, 2},
+    {0xA732, 1, 31, 2}, {0xA779, 1, 2, 2}, {0xA77D, -35332, 1, 1}, {0xA77E, 1, 5, 2},
+    {0xA78B, 1, 1, 1}, {0xA78D, -42280, 1, 1}, {0xA790, 1, 2, 2}, {0xA796, 1, 10, 2},
+    {0xA7AA, -42308, 1, 1}, {0xA7AB, -42319, 1, 1}, {0xA7AC, -42315, 1, 1}, {0xA7AD, -42305, 1, 1},
+    {0xA7AE, -42308, 1, 1}, {0xA7B0, -42258, 1, 1}, {0xA7B1, -42282, 1, 1}, {0xA7B2, -42261, 1, 1},
+    {0xA7B3, 928, 1, 1}, {0xA7B4, 1, 8, 2}, {0xA7C4, -48, 1, 1}, {0xA7C5, -42307, 1, 1},
+    {0xA7C6, -35384, 1, 1}, {0xA7C7, 1, 2, 2}, {0xA7D0, 1, 1, 1}, {0xA7D6, 1, 2, 2},
+    {0xA7F5, 1, 1, 1}, {0xAB70, -38864, 80, 1}, {0xFF21, 32, 26, 1}, {0x10400, 40, 40, 1},
+    {0x104B0, 40, 36, 1}, {0x10570, 39, 11, 1}, {0x1057C, 39, 15, 1}, {0x1058C, 39, 7, 1},
+    {0x10594, 39, 2, 1}, {0x10C80, 64, 51, 1}, {0x118A0, 32, 32, 1}, {0x16E40, 32, 32, 1},
+    {0x1E900, 34, 34, 1}
+
+};
+
+uint32_t foldCodePoint(uint32_t codePoint) {
+    const CaseFoldRun* run = upper_bound(begin(caseFoldRuns), end(caseFoldRuns), codePoint,
+                                         [](uint32_t cp, const CaseFoldRun& r) { return cp < r.first; });
+    if (run == begin(caseFoldRuns)) {
+        return codePoint;
+    }
+    --run;
+    uint32_t offset = codePoint - run->first;
+    if (offset % run->stride != 0 || offset / run->stride >= run->count) {
+        return codePoint;
+    }
+    return static_cast<uint32_t>(static_cast<int32_t>(codePoint) + run->delta);
+}
+
+// Folds the UTF-8 sequence at the start of text into out and returns the number of input
+// bytes consumed. Malformed sequences are copied through one byte at a time, so folding is
+// total and the same bytes always fold the same way at build and query time.
+size_t foldUtf8Sequence(const unsigned char* text, size_t available, char*& out) {
+    unsigned char lead = text[0];
+    size_t length = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+    uint32_t codePoint = lead & (0x7F >> length);
+    bool valid = length > 1 && lead <= 0xF4 && length <= available;
+    for (size_t i = 1; valid && i < length; ++i) {
+        valid = (text[i] & 0xC0) == 0x80;
+        codePoint = (codePoint << 6) | (text[i] & 0x3F);
+    }
+    static constexpr uint32_t smallest[] = {0, 0, 0x80, 0x800, 0x10000};
+    if (!valid || codePoint < smallest[length] || (codePoint >= 0xD800 && codePoint <= 0xDFFF) || codePoint > 0x10FFFF) {
+        *out++ = static_cast<char>(lead);
+        return 1;
+    }
+    codePoint = foldCodePoint(codePoint);
+    if (codePoint < 0x80) {
+        *out++ = static_cast<char>(codePoint);
+    } else if (codePoint < 0x800) {
+        *out++ = static_cast<char>(0xC0 | (codePoint >> 6));
+        *out++ = static_cast<char>(0x80 | (codePoint & 0x3F));
+    } else if (codePoint < 0x10000) {
+        *out++ = static_cast<char>(0xE0 | (codePoint >> 12));
+        *out++ = static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+        *out++ = static_cast<char>(0x80 | (codePoint & 0x3F));
+    } else {
+        *out++ = static_cast<char>(0xF0 | (codePoint >> 18));
+        *out++ = static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F));
+        *out++ = static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+        *out++ = static_cast<char>(0x80 | (codePoint & 0x3F));
+    }
+    return length;
+}
+
+// Simple folding can lengthen a sequence by half (U+023A is two bytes, its folding three),
+// so this is the output space foldCase needs for size input bytes.
+constexpr size_t maxFoldedSize(size_t size) {
+    return size + size / 2;
+}
+
+// Lowercases eight ASCII bytes held in a word. No byte is above 0x7F, so adding 0x3F sets a
+// byte's top bit exactly when it is at least 'A' and adding 0x25 when it is past 'Z', and
+// neither sum carries into the next byte.
+uint64_t lowerAsciiWord(uint64_t word) {
+    const uint64_t ones = 0x0101010101010101;
+    uint64_t upper = (word + 0x3F * ones) & ~(word + 0x25 * ones) & (0x80 * ones);
+    return word | (upper >> 2);
+}
+
+// Case-folds text into out, which must hold maxFoldedSize(text.size()) bytes, and returns the
+// folded length. Pure-ASCII blocks are lowercased 32 or 16 bytes at a time; a block holding a
+// non-ASCII byte is still stored whole, but only its ASCII prefix is kept before the UTF-8
+// sequence is folded one code point at a time. The spare output space covers the overshoot.
+// Most city names are shorter than a vector block, so eight ASCII bytes at a time go through
+// one 64-bit word, which also serves targets without SSE2; only the tail and non-ASCII text
+// take the byte loop.
+size_t foldCase(string_view text, char* out) {
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(text.data());
+    size_t size = text.size();
+    size_t pos = 0;
+    char* start = out;
+    while (pos < size) {
+#ifdef __AVX2__
+        if (size - pos >= 32) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + pos));
+            __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(block, _mm256_set1_epi8('A' - 1)),
+                                             _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), block));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out),
+                                _mm256_add_epi8(block, _mm256_and_si256(upper, _mm256_set1_epi8(0x20))));
+            uint32_t nonAscii = static_cast<uint32_t>(_mm256_movemask_epi8(block));
+            size_t ascii = nonAscii ? countr_zero(nonAscii) : 32;
+            pos += ascii;
+            out += ascii;
+            if (nonAscii) {
+                pos += foldUtf8Sequence(in + pos, size - pos, out);
+            }
+            continue;
+        }
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+        if (size - pos >= 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + pos));
+            __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('A' - 1)),
+                                          _mm_cmplt_epi8(block, _mm_set1_epi8('Z' + 1)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_add_epi8(block, _mm_and_si128(upper, _mm_set1_epi8(0x20))));
+            uint32_t nonAscii = static_cast<uint32_t>(_mm_movemask_epi8(block));
+            size_t ascii = nonAscii ? countr_zero(nonAscii) : 16;
+            pos += ascii;
+            out += ascii;
+            if (nonAscii) {
+                pos += foldUtf8Sequence(in + pos, size - pos, out);
+            }
+            continue;
+        }
+#endif
+        if (size - pos >= 8) {
+            uint64_t word;
+            memcpy(&word, in + pos, sizeof(word));
+            if ((word & 0x8080808080808080) == 0) {
+                word = lowerAsciiWord(word);
+                memcpy(out, &word, sizeof(word));
+                pos += 8;
+                out += 8;
+                continue;
+            }
+        }
+        unsigned char c = in[pos];
+        if (c < 0x80) {
+            *out++ = static_cast<char>(c >= 'A' && c <= 'Z' ? c + 0x20 : c);
+            ++pos;
+        } else {
+            pos += foldUtf8Sequence(in + pos, size - pos, out);
+        }
+    }
+    return static_cast<size_t>(out - start);
+}
+
+string toLower(string_view s) {
+    string result(maxFoldedSize(s.size()), '\0');
+    result.resize(foldCase(s, result.data()));
     return result;
 }
 
-struct TrieNode {
-    bool isEndOfWord;
-    unordered_map<string, double> countryPopulation;
-    unordered_map<char, TrieNode*> children;
-    TrieNode() : isEndOfWord(false) {}
+// Case-folded copy of a lookup key held in an inline buffer, so building it does not touch
+// the heap; only text longer than the buffer spills into a string. The two-part form builds
+// the "country|city" cache key.
+class FoldedText {
+private:
+    static constexpr size_t inlineCapacity = 128;
+    char buffer[inlineCapacity];
+    string overflow;
+    size_t length = 0;
+
+    char* reserve(size_t size) {
+        if (size <= inlineCapacity) {
+            return buffer;
+        }
+        overflow.resize(size);
+        return overflow.data();
+    }
+
+    // The folded length is only known afterwards, so the buffer is chosen by the worst case;
+    // view() must then look wherever the text was written.
+    bool inlineText() const {
+        return overflow.empty();
+    }
+
+public:
+    FoldedText() = default;
+
+    explicit FoldedText(string_view text) {
+        assign(text);
+    }
+
+    FoldedText(string_view first, char separator, string_view second) {
+        char* out = reserve(maxFoldedSize(first.size()) + 1 + maxFoldedSize(second.size()));
+        length = foldCase(first, out);
+        out[length++] = separator;
+        length += foldCase(second, out + length);
+    }
+
+    FoldedText(const FoldedText&) = delete;
+    FoldedText& operator=(const FoldedText&) = delete;
+
+    void assign(string_view text) {
+        overflow.clear();
+        length = foldCase(text, reserve(maxFoldedSize(text.size())));
+    }
+
+    string_view view() const {
+        return {inlineText() ? buffer : overflow.data(), length};
+    }
+};
+
+// Lets string-keyed hash maps be probed with a string_view without building a string.
+struct StringViewHash {
+    using is_transparent = void;
+    size_t operator()(string_view text) const {
+        return hash<string_view>{}(text);
+    }
+};
+
+template<typename Value>
+using StringMap = unordered_map<string, Value, StringViewHash, equal_to<>>;
+
+struct CityRow {
+    string city;
+    string country;
+    double population;
+
+    bool operator==(const CityRow&) const = default;
+};
+
+struct CityQuery {
+    string_view city;
+    string_view country;
+};
+
+// Lookups processed together by the batched searchMany implementations; enough to keep
+// several cache misses in flight without the cursors themselves spilling out of L1.
+constexpr size_t searchBatchWidth = 16;
+
+// Flat tries with fewer node bytes than this stay cache-resident, so the lockstep walk has
+// no misses to overlap and measured no faster than looping over search; they skip it.
+constexpr size_t flatBatchMinNodeBytes = size_t(4) << 20;
+
+inline void prefetch(const void* address) {
+#if defined(_MSC_VER)
+    _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#else
+    __builtin_prefetch(address);
+#endif
+}
+
+struct FuzzyMatch {
+    CityRow city;
+    int distance;
+};
+
+class CityIndex {
+public:
+    virtual ~CityIndex() = default;
+    virtual void insert(string_view cityName, string_view countryCode, double population) = 0;
+    virtual double search(string_view cityName, string_view countryCode) = 0;
+    virtual size_t memoryUsage() const = 0;
+    virtual size_t nodeCount() const = 0;
+    virtual void finalize() {}
+
+    // Resolves queries[i] into results[i]. Implementations may interleave the lookups so their
+    // cache misses overlap; the default simply loops over search.
+    virtual void searchMany(span<const CityQuery> queries, span<double> results) {
+        for (size_t i = 0; i < queries.size(); ++i) {
+            results[i] = search(queries[i].city, queries[i].country);
+        }
+    }
 };
 
-class NameTrie {
+// Interns lowercased country codes to dense 16-bit ids.
+class CountryCodes {
 private:
-    TrieNode* root;
+    StringMap<uint16_t> ids;
+    vector<string> codes;
+
+public:
+    uint16_t intern(string_view lowerCode) {
+        auto it = ids.find(lowerCode);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        if (codes.size() > numeric_limits<uint16_t>::max()) {
+            throw overflow_error("more than 65536 distinct country codes");
+        }
+        uint16_t id = static_cast<uint16_t>(codes.size());
+        codes.emplace_back(lowerCode);
+        ids.emplace(codes.back(), id);
+        return id;
+    }
+
+    // Returns -1 for codes that were never interned.
+    int find(string_view lowerCode) const {
+        auto it = ids.find(lowerCode);
+        return it == ids.end() ? -1 : it->second;
+    }
+
+    const string& code(uint16_t id) const {
+        return codes[id];
+    }
+
+    size_t size() const {
+        return codes.size();
+    }
+
+    size_t memoryUsage() const {
+        size_t bytes = sizeof(CountryCodes) + codes.capacity() * sizeof(string);
+        bytes += ids.bucket_count() * sizeof(void*);
+        bytes += ids.size() * (sizeof(void*) + sizeof(size_t) + sizeof(pair<const string, uint16_t>));
+        return bytes;
+    }
+};
+
+// Column-wise city storage addressed by a 32-bit city id. Names live back to back in one
+// character pool, country codes are interned to 16-bit ids, and populations sit in their
+// own column, so a row costs 18 bytes plus its name and no allocation of its own. Rows are
+// appended; set() rewrites one in place, leaving a replaced name's bytes in the pool.
+class CityTable {
+private:
+    string namePool;
+    vector<uint32_t> nameOffsets;
+    vector<uint32_t> nameLengths;
+    vector<uint16_t> countryIds;
+    vector<double> populations;
+    CountryCodes countries;
+
+    void storeName(uint32_t id, string_view name) {
+        if (namePool.size() + name.size() > numeric_limits<uint32_t>::max()) {
+            throw overflow_error("city name pool exceeds 4 GiB");
+        }
+        nameOffsets[id] = static_cast<uint32_t>(namePool.size());
+        nameLengths[id] = static_cast<uint32_t>(name.size());
+        namePool.append(name);
+    }
+
+public:
+    uint32_t add(string_view cityName, string_view countryCode, double population) {
+        uint32_t id = static_cast<uint32_t>(populations.size());
+        nameOffsets.push_back(0);
+        nameLengths.push_back(0);
+        storeName(id, cityName);
+        countryIds.push_back(countries.intern(countryCode));
+        populations.push_back(population);
+        return id;
+    }
+
+    void set(uint32_t id, string_view cityName, string_view countryCode, double population) {
+        if (city(id) != cityName) {
+            storeName(id, cityName);
+        }
+        countryIds[id] = countries.intern(countryCode);
+        populations[id] = population;
+    }
+
+    void setPopulation(uint32_t id, double population) {
+        populations[id] = population;
+    }
+
+    // Collapses rows repeating a (city, country) key, compared case-folded, into the first
+    // of them, which takes the last one's spelling and population as repeated inserts into an
+    // index would. Later rows move up so ids stay dense. Returns the number of rows dropped.
+    size_t dedupe() {
+        StringMap<uint32_t> firstIds;
+        firstIds.reserve(size());
+        uint32_t kept = 0;
+        for (uint32_t id = 0; id < size(); ++id) {
+            auto [it, added] = firstIds.try_emplace(string(FoldedText(country(id), '|', city(id)).view()), kept);
+            if (!added) {
+                set(it->second, city(id), country(id), population(id));
+                continue;
+            }
+            nameOffsets[kept] = nameOffsets[id];
+            nameLengths[kept] = nameLengths[id];
+            countryIds[kept] = countryIds[id];
+            populations[kept] = populations[id];
+            ++kept;
+        }
+        size_t dropped = size() - kept;
+        nameOffsets.resize(kept);
+        nameLengths.resize(kept);
+        countryIds.resize(kept);
+        populations.resize(kept);
+        return dropped;
+    }
+
+    void append(const CityTable& other) {
+        reserve(size() + other.size(), namePool.size() + other.namePool.size());
+        for (uint32_t id = 0; id < other.size(); ++id) {
+            add(other.city(id), other.country(id), other.population(id));
+        }
+    }
+
+    void reserve(size_t rows, size_t poolBytes) {
+        namePool.reserve(poolBytes);
+        nameOffsets.reserve(rows);
+        nameLengths.reserve(rows);
+        countryIds.reserve(rows);
+        populations.reserve(rows);
+    }
+
+    string_view city(uint32_t id) const {
+        return string_view(namePool).substr(nameOffsets[id], nameLengths[id]);
+    }
+
+    string_view country(uint32_t id) const {
+        return countries.code(countryIds[id]);
+    }
+
+    double population(uint32_t id) const {
+        return populations[id];
+    }
+
+    CityRow row(uint32_t id) const {
+        return {string(city(id)), string(country(id)), population(id)};
+    }
+
+    vector<CityRow> rows() const {
+        vector<CityRow> out;
+        out.reserve(size());
+        for (uint32_t id = 0; id < size(); ++id) {
+            out.push_back(row(id));
+        }
+        return out;
+    }
+
+    size_t size() const {
+        return populations.size();
+    }
+
+    bool empty() const {
+        return populations.empty();
+    }
+
+    size_t memoryUsage() const {
+        return sizeof(CityTable) + namePool.capacity() + (nameOffsets.capacity() + nameLengths.capacity()) * sizeof(uint32_t) +
+               countryIds.capacity() * sizeof(uint16_t) + populations.capacity() * sizeof(double) + countries.memoryUsage() -
+               sizeof(CountryCodes);
+    }
+};
+
+// Hash and equality over the case-folded (country, city) key of a CityTable row, so a set
+// of row ids stands in for a map from key to id without a second copy of the names. Both
+// also take the key as a CityQuery for lookups.
+struct CityKeyHash {
+    using is_transparent = void;
+    const CityTable* table;
+
+    size_t operator()(const CityQuery& key) const {
+        return hash<string_view>{}(FoldedText(key.country, '|', key.city).view());
+    }
+
+    size_t operator()(uint32_t id) const {
+        return (*this)(CityQuery{table->city(id), table->country(id)});
+    }
+};
+
+struct CityKeyEqual {
+    using is_transparent = void;
+    const CityTable* table;
+
+    bool operator()(const CityQuery& a, const CityQuery& b) const {
+        return FoldedText(a.country, '|', a.city).view() == FoldedText(b.country, '|', b.city).view();
+    }
+
+    bool operator()(uint32_t a, const CityQuery& b) const {
+        return (*this)(CityQuery{table->city(a), table->country(a)}, b);
+    }
+
+    bool operator()(const CityQuery& a, uint32_t b) const {
+        return (*this)(b, a);
+    }
+
+    bool operator()(uint32_t a, uint32_t b) const {
+        return a == b || (*this)(a, CityQuery{table->city(b), table->country(b)});
+    }
+};
+
+using CityKeySet = unordered_set<uint32_t, CityKeyHash, CityKeyEqual>;
+
+// One country's payload at a terminal node; cityId is the row in the NameTrie's CityTable.
+struct CountryPopulation {
+    uint16_t countryId;
+    uint32_t cityId;
+    double population;
+};
+
+struct TrieNode;
+
+// Adaptive child table in the style of ART's Node4/16/48/256. Small fan-outs keep their edge
+// labels in a packed byte array that is matched 16 at a time with SSE2 compare + movemask
+// (a scalar loop elsewhere); wider ones switch to a 256-entry byte index into 48 slots and
+// finally to a direct 256-pointer array. Storage comes from the owning trie's resource.
+class TrieChildren {
+private:
+    struct Packed4 {
+        unsigned char keys[4];
+        TrieNode* children[4];
+    };
+    struct Packed16 {
+        unsigned char keys[16];
+        TrieNode* children[16];
+    };
+    struct Indexed48 {
+        unsigned char slots[256];
+        TrieNode* children[48];
+    };
+    struct Direct256 {
+        TrieNode* children[256];
+    };
+
+    enum Kind : uint8_t { Empty, Node4, Node16, Node48, Node256 };
+
+    pmr::memory_resource* owner;
+    void* storage;
+    uint16_t count;
+    Kind kind;
+
+    static size_t storageBytes(Kind kind) {
+        switch (kind) {
+            case Node4: return sizeof(Packed4);
+            case Node16: return sizeof(Packed16);
+            case Node48: return sizeof(Indexed48);
+            case Node256: return sizeof(Direct256);
+            default: return 0;
+        }
+    }
+
+    template<typename T>
+    T* as() const {
+        return static_cast<T*>(storage);
+    }
+
+    // keys must be readable for 4 bytes when count <= 4 and for 16 bytes otherwise.
+    static int findKey(const unsigned char* keys, uint16_t count, unsigned char key) {
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+        __m128i packed;
+        if (count <= 4) {
+            int32_t word;
+            memcpy(&word, keys, sizeof(word));
+            packed = _mm_cvtsi32_si128(word);
+        } else {
+            packed = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys));
+        }
+        __m128i matches = _mm_cmpeq_epi8(_mm_set1_epi8(static_cast<char>(key)), packed);
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(matches)) & ((1u << count) - 1);
+        return mask ? countr_zero(mask) : -1;
+#endif
+        for (uint16_t i = 0; i < count; ++i) {
+            if (keys[i] == key) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    void grow() {
+        Kind next = kind == Empty ? Node4 : kind == Node4 ? Node16 : kind == Node16 ? Node48 : Node256;
+        void* fresh = owner->allocate(storageBytes(next), alignof(TrieNode*));
+        memset(fresh, 0, storageBytes(next));
+        if (next == Node16) {
+            Packed16* target = static_cast<Packed16*>(fresh);
+            memcpy(target->keys, as<Packed4>()->keys, count);
+            memcpy(target->children, as<Packed4>()->children, count * sizeof(TrieNode*));
+        } else if (next == Node48) {
+            Indexed48* target = static_cast<Indexed48*>(fresh);
+            for (uint16_t i = 0; i < count; ++i) {
+                target->slots[as<Packed16>()->keys[i]] = static_cast<unsigned char>(i + 1);
+                target->children[i] = as<Packed16>()->children[i];
+            }
+        } else if (next == Node256) {
+            Direct256* target = static_cast<Direct256*>(fresh);
+            for (int key = 0; key < 256; ++key) {
+                if (as<Indexed48>()->slots[key]) {
+                    target->children[key] = as<Indexed48>()->children[as<Indexed48>()->slots[key] - 1];
+                }
+            }
+        }
+        release();
+        storage = fresh;
+        kind = next;
+    }
+
+    void release() {
+        if (storage) {
+            owner->deallocate(storage, storageBytes(kind), alignof(TrieNode*));
+        }
+        storage = nullptr;
+    }
 
 public:
-    NameTrie() {
-        root = new TrieNode();
+    class iterator {
+    private:
+        const TrieChildren* table;
+        int position;
+
+        void settle() {
+            if (table->kind == Node48) {
+                while (position < 256 && !table->as<Indexed48>()->slots[position]) ++position;
+            } else if (table->kind == Node256) {
+                while (position < 256 && !table->as<Direct256>()->children[position]) ++position;
+            }
+        }
+
+    public:
+        iterator(const TrieChildren* table, int position) : table(table), position(position) {
+            settle();
+        }
+
+        pair<char, TrieNode*> operator*() const {
+            switch (table->kind) {
+                case Node4: return {static_cast<char>(table->as<Packed4>()->keys[position]), table->as<Packed4>()->children[position]};
+                case Node16: return {static_cast<char>(table->as<Packed16>()->keys[position]), table->as<Packed16>()->children[position]};
+                case Node48: return {static_cast<char>(position), table->as<Indexed48>()->children[table->as<Indexed48>()->slots[position] - 1]};
+                default: return {static_cast<char>(position), table->as<Direct256>()->children[position]};
+            }
+        }
+
+        iterator& operator++() {
+            ++position;
+            settle();
+            return *this;
+        }
+
+        bool operator!=(const iterator& other) const {
+            return position != other.position;
+        }
+    };
+
+    explicit TrieChildren(pmr::memory_resource* resource) : owner(resource), storage(nullptr), count(0), kind(Empty) {}
+
+    ~TrieChildren() {
+        release();
+    }
+
+    TrieChildren(const TrieChildren&) = delete;
+    TrieChildren& operator=(const TrieChildren&) = delete;
+
+    TrieNode* find(char c) const {
+        unsigned char key = static_cast<unsigned char>(c);
+        switch (kind) {
+            case Node4: {
+                int i = findKey(as<Packed4>()->keys, count, key);
+                return i < 0 ? nullptr : as<Packed4>()->children[i];
+            }
+            case Node16: {
+                int i = findKey(as<Packed16>()->keys, count, key);
+                return i < 0 ? nullptr : as<Packed16>()->children[i];
+            }
+            case Node48: {
+                unsigned char slot = as<Indexed48>()->slots[key];
+                return slot ? as<Indexed48>()->children[slot - 1] : nullptr;
+            }
+            case Node256:
+                return as<Direct256>()->children[key];
+            default:
+                return nullptr;
+        }
+    }
+
+    // Adds or replaces the child labelled c.
+    void set(char c, TrieNode* child) {
+        unsigned char key = static_cast<unsigned char>(c);
+        if (kind == Node256) {
+            count += as<Direct256>()->children[key] == nullptr;
+            as<Direct256>()->children[key] = child;
+            return;
+        }
+        if (kind == Node48 && as<Indexed48>()->slots[key]) {
+            as<Indexed48>()->children[as<Indexed48>()->slots[key] - 1] = child;
+            return;
+        }
+        if (kind == Node4 || kind == Node16) {
+            unsigned char* keys = kind == Node4 ? as<Packed4>()->keys : as<Packed16>()->keys;
+            TrieNode** children = kind == Node4 ? as<Packed4>()->children : as<Packed16>()->children;
+            int i = findKey(keys, count, key);
+            if (i >= 0) {
+                children[i] = child;
+                return;
+            }
+        }
+        if (kind == Empty || (kind == Node4 && count == 4) || (kind == Node16 && count == 16) || (kind == Node48 && count == 48)) {
+            grow();
+        }
+        switch (kind) {
+            case Node4:
+                as<Packed4>()->keys[count] = key;
+                as<Packed4>()->children[count] = child;
+                break;
+            case Node16:
+                as<Packed16>()->keys[count] = key;
+                as<Packed16>()->children[count] = child;
+                break;
+            case Node48:
+                as<Indexed48>()->slots[key] = static_cast<unsigned char>(count + 1);
+                as<Indexed48>()->children[count] = child;
+                break;
+            default:
+                as<Direct256>()->children[key] = child;
+                break;
+        }
+        ++count;
+    }
+
+    // Removes the child labelled c, if any. Tables keep their kind until they empty out.
+    void erase(char c) {
+        unsigned char key = static_cast<unsigned char>(c);
+        if (kind == Node4 || kind == Node16) {
+            unsigned char* keys = kind == Node4 ? as<Packed4>()->keys : as<Packed16>()->keys;
+            TrieNode** children = kind == Node4 ? as<Packed4>()->children : as<Packed16>()->children;
+            int i = findKey(keys, count, key);
+            if (i < 0) {
+                return;
+            }
+            keys[i] = keys[count - 1];
+            children[i] = children[count - 1];
+        } else if (kind == Node48) {
+            Indexed48* table = as<Indexed48>();
+            unsigned char slot = table->slots[key];
+            if (!slot) {
+                return;
+            }
+            // Keep the children dense by moving the last one into the freed slot.
+            for (int other = 0; other < 256; ++other) {
+                if (table->slots[other] == count) {
+                    table->slots[other] = slot;
+                    break;
+                }
+            }
+            table->children[slot - 1] = table->children[count - 1];
+            table->slots[key] = 0;
+        } else if (kind == Node256) {
+            if (!as<Direct256>()->children[key]) {
+                return;
+            }
+            as<Direct256>()->children[key] = nullptr;
+        } else {
+            return;
+        }
+        if (--count == 0) {
+            clear();
+        }
+    }
+
+    void clear() {
+        release();
+        count = 0;
+        kind = Empty;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    pmr::memory_resource* resource() const {
+        return owner;
+    }
+
+    size_t memoryUsage() const {
+        return storageBytes(kind);
+    }
+
+    iterator begin() const {
+        return iterator(this, 0);
+    }
+
+    iterator end() const {
+        return iterator(this, kind == Node48 || kind == Node256 ? 256 : count);
+    }
+};
+
+struct TrieNode {
+    static constexpr uint16_t inlineCountryCapacity = 2;
+
+    bool isEndOfWord;
+    // Length of the overall top list at the front of topCities.
+    uint8_t topCount;
+    // Terminal payload sorted by country id. Up to inlineCountryCapacity entries live in the
+    // node itself; past that all of them move to overflowCountries.
+    uint16_t countryCount;
+    CountryPopulation inlineCountries[inlineCountryCapacity];
+    pmr::vector<CountryPopulation> overflowCountries;
+    TrieChildren children;
+    // Ids of the subtree's most populous cities, each list sorted by descending population
+    // and at most NameTrie::maxCompletions long: the overall list in [0, topCount), then one
+    // list per country present below, grouped in ascending country id.
+    pmr::vector<uint32_t> topCities;
+    explicit TrieNode(pmr::memory_resource* resource)
+        : isEndOfWord(false), topCount(0), countryCount(0), inlineCountries{}, overflowCountries(resource), children(resource), topCities(resource) {}
+
+    const CountryPopulation* countriesBegin() const {
+        return countryCount <= inlineCountryCapacity ? inlineCountries : overflowCountries.data();
+    }
+
+    const CountryPopulation* countriesEnd() const {
+        return countriesBegin() + countryCount;
+    }
+
+    const CountryPopulation* findCountry(uint16_t countryId) const {
+        for (const CountryPopulation* it = countriesBegin(); it != countriesEnd() && it->countryId <= countryId; ++it) {
+            if (it->countryId == countryId) {
+                return it;
+            }
+        }
+        return nullptr;
+    }
+
+    void setCountry(uint16_t countryId, uint32_t cityId, double population) {
+        if (const CountryPopulation* existing = findCountry(countryId)) {
+            const_cast<CountryPopulation*>(existing)->population = population;
+            return;
+        }
+        if (countryCount == inlineCountryCapacity) {
+            overflowCountries.assign(inlineCountries, inlineCountries + inlineCountryCapacity);
+        }
+        CountryPopulation entry{countryId, cityId, population};
+        if (countryCount < inlineCountryCapacity) {
+            CountryPopulation* end = inlineCountries + countryCount;
+            CountryPopulation* at = find_if(inlineCountries, end, [&](const CountryPopulation& p) { return p.countryId > countryId; });
+            move_backward(at, end, end + 1);
+            *at = entry;
+        } else {
+            auto at = find_if(overflowCountries.begin(), overflowCountries.end(), [&](const CountryPopulation& p) { return p.countryId > countryId; });
+            overflowCountries.insert(at, entry);
+        }
+        ++countryCount;
+    }
+
+    bool eraseCountry(uint16_t countryId) {
+        const CountryPopulation* existing = findCountry(countryId);
+        if (!existing) {
+            return false;
+        }
+        if (countryCount <= inlineCountryCapacity) {
+            CountryPopulation* at = inlineCountries + (existing - inlineCountries);
+            move(at + 1, inlineCountries + countryCount, at);
+        } else {
+            overflowCountries.erase(overflowCountries.begin() + (existing - overflowCountries.data()));
+            if (overflowCountries.size() == inlineCountryCapacity) {
+                copy(overflowCountries.begin(), overflowCountries.end(), inlineCountries);
+                overflowCountries.clear();
+                overflowCountries.shrink_to_fit();
+            }
+        }
+        --countryCount;
+        return true;
+    }
+};
+
+// Shape and footprint of a NameTrie, gathered by NameTrie::stats() in one walk.
+struct TrieStats {
+    size_t nodes = 0;
+    size_t terminals = 0;
+    size_t cities = 0;
+    size_t nodeBytes = 0;
+    size_t totalBytes = 0;
+    // fanOut[k] counts nodes with k children; depth[d] counts nodes d edges below the root.
+    vector<size_t> fanOut;
+    vector<size_t> depth;
+
+    double bytesPerCity() const {
+        return cities ? static_cast<double>(totalBytes) / cities : 0.0;
+    }
+};
+
+class NameTrie : public CityIndex {
+public:
+    static constexpr size_t maxCompletions = 10;
+
+private:
+    // Nodes and their containers come from one resource. By default that is a bump arena
+    // owned by the trie, which makes allocation a pointer increment and hands everything
+    // back in a few large frees when the trie is destroyed.
+    pmr::monotonic_buffer_resource arena;
+    pmr::memory_resource* resource;
+    TrieNode* root;
+    CountryCodes countries;
+    // Worker tries from indexRows whose subtrees now hang under root; kept alive for their
+    // arenas.
+    vector<unique_ptr<NameTrie>> adoptedParts;
+    // Every (city, country) indexed, referenced by id from the node payloads and top lists:
+    // ownCities, or a table shared with the caller. The trie appends and updates its rows.
+    CityTable ownCities;
+    CityTable* cities;
+    // Interned country of every city id, which orders the per-country top lists.
+    vector<uint16_t> countryOf;
+    // City ids grouped by country id, each group by descending population: country c owns
+    // countryCities[countryStart[c], countryStart[c + 1]). Rebuilt after inserts.
+    vector<uint32_t> countryStart;
+    vector<uint32_t> countryCities;
+    bool countryIndexStale = true;
+    // Ids of erased cities, reused by later inserts; erased[id] marks them until then.
+    vector<uint32_t> freeIds;
+    vector<bool> erased;
+
+    // The slice of node->topCities holding the top list of country countryId, or the empty
+    // slice where it would go.
+    pair<size_t, size_t> countryTopRange(const TrieNode* node, uint16_t countryId) const {
+        const pmr::vector<uint32_t>& top = node->topCities;
+        size_t first = lower_bound(top.begin() + node->topCount, top.end(), countryId, [&](uint32_t id, uint16_t country) {
+            return countryOf[id] < country;
+        }) - top.begin();
+        size_t last = first;
+        while (last < top.size() && countryOf[top[last]] == countryId) {
+            ++last;
+        }
+        return {first, last};
+    }
+
+    // Recomputes the list in node->topCities[first, last), the overall one or with
+    // countryId >= 0 that country's, from the node's own cities and its children's matching
+    // lists, which between them hold every city that can rank among the node's top
+    // maxCompletions. Returns the new length.
+    size_t refillTop(TrieNode* node, size_t first, size_t last, int countryId) {
+        vector<uint32_t> candidates;
+        if (node->isEndOfWord) {
+            for (const CountryPopulation* entry = node->countriesBegin(); entry != node->countriesEnd(); ++entry) {
+                if (countryId < 0 || entry->countryId == countryId) {
+                    candidates.push_back(entry->cityId);
+                }
+            }
+        }
+        for (const auto& child : node->children) {
+            const pmr::vector<uint32_t>& top = child.second->topCities;
+            auto [childFirst, childLast] = countryId < 0 ? pair<size_t, size_t>(0, child.second->topCount)
+                                                         : countryTopRange(child.second, static_cast<uint16_t>(countryId));
+            candidates.insert(candidates.end(), top.begin() + childFirst, top.begin() + childLast);
+        }
+        size_t n = min(maxCompletions, candidates.size());
+        partial_sort(candidates.begin(), candidates.begin() + n, candidates.end(), [&](uint32_t a, uint32_t b) {
+            return cities->population(a) > cities->population(b);
+        });
+        pmr::vector<uint32_t>& top = node->topCities;
+        top.erase(top.begin() + first, top.begin() + last);
+        top.insert(top.begin() + first, candidates.begin(), candidates.begin() + n);
+        return n;
+    }
+
+    // Counting sort on country id, then a population sort within each group. Only rows the
+    // trie has indexed count; a shared table may hold more until indexRows runs.
+    void buildCountryIndex() {
+        countryStart.assign(countries.size() + 1, 0);
+        for (uint32_t id = 0; id < countryOf.size(); ++id) {
+            if (!isErased(id)) {
+                ++countryStart[countryOf[id] + 1];
+            }
+        }
+        partial_sum(countryStart.begin(), countryStart.end(), countryStart.begin());
+        countryCities.resize(countryStart.back());
+        vector<uint32_t> next(countryStart.begin(), countryStart.end() - 1);
+        for (uint32_t id = 0; id < countryOf.size(); ++id) {
+            if (!isErased(id)) {
+                countryCities[next[countryOf[id]]++] = id;
+            }
+        }
+        for (size_t c = 0; c + 1 < countryStart.size(); ++c) {
+            stable_sort(countryCities.begin() + countryStart[c], countryCities.begin() + countryStart[c + 1],
+                        [&](uint32_t a, uint32_t b) { return cities->population(a) > cities->population(b); });
+        }
+        countryIndexStale = false;
+    }
+
+    // Ranks id into the list node->topCities[first, last), keeping it sorted by descending
+    // population and at most maxCompletions long. Returns the new length.
+    size_t offerTop(TrieNode* node, size_t first, size_t last, uint32_t id) {
+        pmr::vector<uint32_t>& top = node->topCities;
+        double population = cities->population(id);
+        auto at = find_if(top.begin() + first, top.begin() + last, [&](uint32_t other) {
+            return cities->population(other) < population;
+        });
+        if (static_cast<size_t>(at - top.begin()) - first >= maxCompletions) {
+            return last - first;
+        }
+        top.insert(at, id);
+        if (++last - first > maxCompletions) {
+            top.erase(top.begin() + --last);
+        }
+        return last - first;
+    }
+
+    // Moves id, whose population just changed, to its new place in the list at [first, last).
+    size_t rerankTop(TrieNode* node, size_t first, size_t last, uint32_t id, bool decreased, int countryId) {
+        pmr::vector<uint32_t>& top = node->topCities;
+        auto existing = find(top.begin() + first, top.begin() + last, id);
+        bool wasListed = existing != top.begin() + last;
+        // A lowered population may let a city that was evicted earlier back into a full list,
+        // and only the children's lists can say which.
+        if (decreased && wasListed && last - first == maxCompletions) {
+            return refillTop(node, first, last, countryId);
+        }
+        if (wasListed) {
+            top.erase(existing);
+            --last;
+        }
+        return offerTop(node, first, last, id);
+    }
+
+    // Takes an erased id out of the list at [first, last), refilling it if it was full.
+    size_t dropTop(TrieNode* node, size_t first, size_t last, uint32_t id, int countryId) {
+        pmr::vector<uint32_t>& top = node->topCities;
+        auto listed = find(top.begin() + first, top.begin() + last, id);
+        if (listed == top.begin() + last) {
+            return last - first;
+        }
+        if (last - first == maxCompletions) {
+            return refillTop(node, first, last, countryId);
+        }
+        top.erase(listed);
+        return last - first - 1;
+    }
+
+    void collectIds(const TrieNode* node, int countryId, vector<uint32_t>& out) const {
+        if (node->isEndOfWord) {
+            for (const CountryPopulation* entry = node->countriesBegin(); entry != node->countriesEnd(); ++entry) {
+                if (countryId < 0 || entry->countryId == countryId) {
+                    out.push_back(entry->cityId);
+                }
+            }
+        }
+        for (const auto& child : node->children) {
+            collectIds(child.second, countryId, out);
+        }
+    }
+
+    vector<uint32_t> topByWalk(const TrieNode* node, size_t k, int countryId) const {
+        vector<uint32_t> ids;
+        collectIds(node, countryId, ids);
+        size_t n = min(k, ids.size());
+        partial_sort(ids.begin(), ids.begin() + n, ids.end(), [&](uint32_t a, uint32_t b) {
+            return cities->population(a) > cities->population(b);
+        });
+        ids.resize(n);
+        return ids;
+    }
+
+    struct FuzzyState {
+        const string& query;
+        int countryId;
+        int maxDistance;
+        vector<vector<int>> rows;
+        vector<FuzzyMatch> matches;
+    };
+
+    // Extends the Levenshtein DP row of the parent by the edge label c and prunes the subtree
+    // once every cell exceeds the allowed distance.
+    void fuzzyWalk(const TrieNode* node, size_t depth, FuzzyState& state) const {
+        const vector<int>& row = state.rows[depth];
+        int distance = row[state.query.size()];
+        if (node->isEndOfWord && distance <= state.maxDistance) {
+            for (const CountryPopulation* entry = node->countriesBegin(); entry != node->countriesEnd(); ++entry) {
+                if (state.countryId < 0 || entry->countryId == state.countryId) {
+                    state.matches.push_back({cities->row(entry->cityId), distance});
+                }
+            }
+        }
+        if (state.rows.size() <= depth + 1) {
+            state.rows.emplace_back(state.query.size() + 1);
+        }
+        for (const auto& child : node->children) {
+            vector<int>& next = state.rows[depth + 1];
+            const vector<int>& prev = state.rows[depth];
+            next[0] = prev[0] + 1;
+            int best = next[0];
+            for (size_t j = 1; j <= state.query.size(); ++j) {
+                int substitute = prev[j - 1] + (state.query[j - 1] != child.first);
+                next[j] = min({prev[j] + 1, next[j - 1] + 1, substitute});
+                best = min(best, next[j]);
+            }
+            if (best <= state.maxDistance) {
+                fuzzyWalk(child.second, depth + 1, state);
+            }
+        }
+    }
+
+    // The node itself and the containers it owns, not counting its children.
+    static size_t ownBytes(const TrieNode* node) {
+        return sizeof(TrieNode) + node->children.memoryUsage() + node->overflowCountries.capacity() * sizeof(CountryPopulation) +
+               node->topCities.capacity() * sizeof(uint32_t);
+    }
+
+    static size_t nodeBytes(const TrieNode* node) {
+        size_t bytes = ownBytes(node);
+        for (const auto& child : node->children) {
+            bytes += nodeBytes(child.second);
+        }
+        return bytes;
+    }
+
+    // Everything but the nodes: the city table, shared or not, and the country index.
+    size_t tableBytes() const {
+        size_t bytes = sizeof(NameTrie) - sizeof(CityTable) + cities->memoryUsage() + countries.memoryUsage();
+        bytes += (countryStart.capacity() + countryCities.capacity()) * sizeof(uint32_t) + countryOf.capacity() * sizeof(uint16_t);
+        return bytes;
+    }
+
+    static void collectStats(const TrieNode* node, size_t depth, TrieStats& stats) {
+        ++stats.nodes;
+        stats.terminals += node->isEndOfWord;
+        stats.nodeBytes += ownBytes(node);
+        if (stats.depth.size() <= depth) {
+            stats.depth.resize(depth + 1);
+        }
+        ++stats.depth[depth];
+        ++stats.fanOut[node->children.size()];
+        for (const auto& child : node->children) {
+            collectStats(child.second, depth + 1, stats);
+        }
+    }
+
+    static size_t countNodes(const TrieNode* node) {
+        size_t count = 1;
+        for (const auto& child : node->children) {
+            count += countNodes(child.second);
+        }
+        return count;
+    }
+
+    TrieNode* newNode() {
+        return new (resource->allocate(sizeof(TrieNode), alignof(TrieNode))) TrieNode(resource);
+    }
+
+    // A node's overflowCountries and topCities vectors and its TrieChildren storage are
+    // separate allocations, which only their destructors return when the trie runs without
+    // the arena, so nodes are still destroyed one by one; with the arena the deallocations
+    // themselves are no-ops.
+    // Adopted subtrees were allocated by another trie, so each node goes back to the
+    // resource its own containers were built with.
+    static void destroy(TrieNode* node) {
+        for (const auto& child : node->children) {
+            destroy(child.second);
+        }
+        pmr::memory_resource* owner = node->children.resource();
+        node->~TrieNode();
+        owner->deallocate(node, sizeof(TrieNode), alignof(TrieNode));
+    }
+
+    // Root-to-terminal path for a folded name, creating missing nodes.
+    vector<TrieNode*> pathTo(string_view lowerCity) {
+        vector<TrieNode*> path = {root};
+        for (char c : lowerCity) {
+            TrieNode* next = path.back()->children.find(c);
+            if (!next) {
+                next = newNode();
+                path.back()->children.set(c, next);
+            }
+            path.push_back(next);
+        }
+        return path;
+    }
+
+    // Records id as the payload for countryId at the end of path and brings the top lists
+    // along it up to date, deepest first so that refillTop sees the children's lists updated.
+    void placeCity(const vector<TrieNode*>& path, uint32_t id, uint16_t countryId, double population, bool decreased) {
+        path.back()->isEndOfWord = true;
+        path.back()->setCountry(countryId, id, population);
+        for (size_t depth = path.size(); depth-- > 0;) {
+            TrieNode* node = path[depth];
+            node->topCount = static_cast<uint8_t>(rerankTop(node, 0, node->topCount, id, decreased, -1));
+            auto [first, last] = countryTopRange(node, countryId);
+            rerankTop(node, first, last, id, decreased, countryId);
+        }
+    }
+
+    // Adds table row id, whose key is not indexed yet, without writing to the table.
+    void indexRow(uint32_t id) {
+        placeCity(pathTo(FoldedText(cities->city(id)).view()), id, countryOf[id], cities->population(id), false);
+    }
+
+public:
+    explicit NameTrie(bool useArena = true)
+        : resource(useArena ? static_cast<pmr::memory_resource*>(&arena) : pmr::new_delete_resource()), cities(&ownCities) {
+        root = newNode();
+    }
+
+    // Indexes rows of table, which must outlive the trie, instead of a private table.
+    explicit NameTrie(CityTable& table, bool useArena = true) : NameTrie(useArena) {
+        cities = &table;
+    }
+
+    // Takes table over as the trie's own rows.
+    explicit NameTrie(CityTable&& table, bool useArena = true) : NameTrie(useArena) {
+        ownCities = std::move(table);
+    }
+
+    ~NameTrie() override {
+        destroy(root);
+    }
+
+    NameTrie(const NameTrie&) = delete;
+    NameTrie& operator=(const NameTrie&) = delete;
+
+    // Indexes every row of the table on up to threadCount threads; the trie must not have
+    // indexed anything yet. Rows repeating a key are merged by CityTable::dedupe first, so
+    // the ids are final once this returns. Rows are bucketed by the first byte of their
+    // folded name, and buckets are dealt to workers largest first. Each worker fills a
+    // private NameTrie with its own arena over the same read-only table, so the hot path
+    // takes no locks and the ids need no translation; the finished subtrees are then hung
+    // under the root.
+    void indexRows(unsigned threadCount = 1) {
+        if (!root->children.empty() || root->isEndOfWord) {
+            throw logic_error("indexRows needs an empty trie");
+        }
+        cities->dedupe();
+        countryOf.resize(cities->size());
+        for (uint32_t id = 0; id < cities->size(); ++id) {
+            countryOf[id] = countries.intern(FoldedText(cities->country(id)).view());
+        }
+        countryIndexStale = true;
+        if (threadCount <= 1) {
+            for (uint32_t id = 0; id < cities->size(); ++id) {
+                indexRow(id);
+            }
+            return;
+        }
+
+        vector<vector<uint32_t>> buckets(256);
+        vector<uint32_t> emptyNames;
+        for (uint32_t id = 0; id < cities->size(); ++id) {
+            if (cities->city(id).empty()) {
+                emptyNames.push_back(id);
+            } else {
+                buckets[static_cast<unsigned char>(FoldedText(cities->city(id)).view()[0])].push_back(id);
+            }
+        }
+        vector<size_t> order;
+        for (size_t b = 0; b < buckets.size(); ++b) {
+            if (!buckets[b].empty()) {
+                order.push_back(b);
+            }
+        }
+        sort(order.begin(), order.end(), [&](size_t a, size_t b) { return buckets[a].size() > buckets[b].size(); });
+        threadCount = static_cast<unsigned>(min<size_t>(threadCount, order.size()));
+        vector<vector<size_t>> assigned(threadCount);
+        vector<size_t> load(threadCount, 0);
+        for (size_t b : order) {
+            size_t worker = min_element(load.begin(), load.end()) - load.begin();
+            assigned[worker].push_back(b);
+            load[worker] += buckets[b].size();
+        }
+
+        // Country ids must agree across parts, so each part starts from a copy of the
+        // interned codes and of countryOf.
+        bool useArena = resource == &arena;
+        vector<unique_ptr<NameTrie>> parts;
+        for (unsigned w = 0; w < threadCount; ++w) {
+            parts.push_back(make_unique<NameTrie>(*cities, useArena));
+            parts.back()->countries = countries;
+            parts.back()->countryOf = countryOf;
+        }
+        vector<thread> workers;
+        for (unsigned w = 0; w < threadCount; ++w) {
+            workers.emplace_back([&, w] {
+                for (size_t b : assigned[w]) {
+                    for (uint32_t id : buckets[b]) {
+                        parts[w]->indexRow(id);
+                    }
+                }
+            });
+        }
+        for (thread& worker : workers) {
+            worker.join();
+        }
+
+        for (unsigned w = 0; w < threadCount; ++w) {
+            NameTrie& part = *parts[w];
+            for (const auto& child : part.root->children) {
+                root->children.set(child.first, child.second);
+            }
+            const pmr::vector<uint32_t>& partTop = part.root->topCities;
+            for (size_t i = 0; i < partTop.size(); ++i) {
+                if (i < part.root->topCount) {
+                    root->topCount = static_cast<uint8_t>(offerTop(root, 0, root->topCount, partTop[i]));
+                } else {
+                    auto [first, last] = countryTopRange(root, countryOf[partTop[i]]);
+                    offerTop(root, first, last, partTop[i]);
+                }
+            }
+            part.root->children.clear();
+            adoptedParts.push_back(std::move(parts[w]));
+        }
+        for (uint32_t id : emptyNames) {
+            indexRow(id);
+        }
+    }
+
+    void insert(string_view cityName, string_view countryCode, double population) override {
+        FoldedText lowerCity(cityName);
+        uint16_t countryId = countries.intern(FoldedText(countryCode).view());
+        countryIndexStale = true;
+        vector<TrieNode*> path = pathTo(lowerCity.view());
+        const CountryPopulation* existing = path.back()->isEndOfWord ? path.back()->findCountry(countryId) : nullptr;
+        uint32_t id;
+        bool decreased = false;
+        if (existing) {
+            id = existing->cityId;
+            decreased = population < cities->population(id);
+            cities->set(id, cityName, countryCode, population);
+        } else if (freeIds.empty()) {
+            id = cities->add(cityName, countryCode, population);
+            countryOf.resize(cities->size());
+            countryOf[id] = countryId;
+        } else {
+            id = freeIds.back();
+            freeIds.pop_back();
+            cities->set(id, cityName, countryCode, population);
+            countryOf[id] = countryId;
+            erased[id] = false;
+        }
+        placeCity(path, id, countryId, population, decreased);
+    }
+
+    // Returns up to k cities whose lowercased name starts with prefix, most populous first,
+    // optionally restricted to one country. Requests with k <= maxCompletions are answered
+    // straight from the list precomputed at the prefix node, the overall one or the
+    // country's, so they cost the prefix walk plus k; only longer requests walk the subtree.
+    vector<CityRow> complete(const string& prefix, size_t k, const string& countryCode = "") const {
+        const TrieNode* node = root;
+        string lowerPrefix = toLower(prefix);
+        for (char c : lowerPrefix) {
+            node = node->children.find(c);
+            if (!node) {
+                return {};
+            }
+        }
+
+        int countryId = -1;
+        size_t first = 0;
+        size_t last = node->topCount;
+        if (!countryCode.empty()) {
+            countryId = countries.find(FoldedText(countryCode).view());
+            if (countryId < 0) {
+                return {};
+            }
+            tie(first, last) = countryTopRange(node, static_cast<uint16_t>(countryId));
+        }
+        vector<CityRow> results;
+        if (k > last - first && last - first == maxCompletions) {
+            for (uint32_t id : topByWalk(node, k, countryId)) {
+                results.push_back(cities->row(id));
+            }
+            return results;
+        }
+        for (size_t i = first; i < last && i - first < k; ++i) {
+            results.push_back(cities->row(node->topCities[i]));
+        }
+        return results;
+    }
+
+    void finalize() override {
+        if (countryIndexStale) {
+            buildCountryIndex();
+        }
+    }
+
+    // Removes one (city, country) pair. Nodes left with neither payload nor children are
+    // pruned on the way back up, and the top lists along the path are refilled from the
+    // children's lists, so the cost depends on the name length rather than the trie size.
+    bool erase(string_view cityName, string_view countryCode) {
+        FoldedText lowerCity(cityName);
+        int countryId = countries.find(FoldedText(countryCode).view());
+        if (countryId < 0) {
+            return false;
+        }
+        vector<TrieNode*> path = {root};
+        for (char c : lowerCity.view()) {
+            TrieNode* next = path.back()->children.find(c);
+            if (!next) {
+                return false;
+            }
+            path.push_back(next);
+        }
+        TrieNode* terminal = path.back();
+        const CountryPopulation* entry = terminal->isEndOfWord ? terminal->findCountry(static_cast<uint16_t>(countryId)) : nullptr;
+        if (!entry) {
+            return false;
+        }
+        uint32_t id = entry->cityId;
+        terminal->eraseCountry(static_cast<uint16_t>(countryId));
+        terminal->isEndOfWord = terminal->countryCount > 0;
+        cities->set(id, "", "", 0);
+        erased.resize(cities->size());
+        erased[id] = true;
+        freeIds.push_back(id);
+        countryIndexStale = true;
+
+        for (size_t depth = path.size(); depth-- > 0;) {
+            TrieNode* node = path[depth];
+            if (depth > 0 && !node->isEndOfWord && node->children.empty()) {
+                path[depth - 1]->children.erase(lowerCity.view()[depth - 1]);
+                destroy(node);
+                continue;
+            }
+            node->topCount = static_cast<uint8_t>(dropTop(node, 0, node->topCount, id, -1));
+            auto [first, last] = countryTopRange(node, static_cast<uint16_t>(countryId));
+            dropTop(node, first, last, id, countryId);
+        }
+        return true;
+    }
+
+    // Ids of up to limit cities in one country, most populous first, resolved through
+    // cityRow(). The slice points into the country index, so the cost is independent of
+    // the other countries; the first call after an insert rebuilds the index.
+    span<const uint32_t> citiesInCountry(string_view countryCode, size_t limit = numeric_limits<size_t>::max()) {
+        finalize();
+        int countryId = countries.find(FoldedText(countryCode).view());
+        if (countryId < 0) {
+            return {};
+        }
+        span<const uint32_t> all(countryCities.data() + countryStart[countryId], countryStart[countryId + 1] - countryStart[countryId]);
+        return all.first(min(limit, all.size()));
+    }
+
+    CityRow cityRow(uint32_t id) const {
+        return cities->row(id);
+    }
+
+    // Erased rows stay in the table, blanked, until an insert reuses their id.
+    bool isErased(uint32_t id) const {
+        return id < erased.size() && erased[id];
+    }
+
+    // Returns the cities within maxDistance edits of cityName, closest first and most populous
+    // among equals, optionally restricted to one country and truncated to maxResults.
+    vector<FuzzyMatch> fuzzySearch(const string& cityName, const string& countryCode, int maxDistance, size_t maxResults = 10) const {
+        string lowerCity = toLower(cityName);
+        string lowerCountry = toLower(countryCode);
+        int countryId = lowerCountry.empty() ? -1 : countries.find(lowerCountry);
+        if (!lowerCountry.empty() && countryId < 0) {
+            return {};
+        }
+        FuzzyState state{lowerCity, countryId, maxDistance, {vector<int>(lowerCity.size() + 1)}, {}};
+        iota(state.rows[0].begin(), state.rows[0].end(), 0);
+        fuzzyWalk(root, 0, state);
+        sort(state.matches.begin(), state.matches.end(), [](const FuzzyMatch& a, const FuzzyMatch& b) {
+            if (a.distance != b.distance) return a.distance < b.distance;
+            return a.city.population > b.city.population;
+        });
+        if (state.matches.size() > maxResults) {
+            state.matches.resize(maxResults);
+        }
+        return state.matches;
+    }
+
+    double search(string_view cityName, string_view countryCode) override {
+        TrieNode* node = root;
+        int countryId = countries.find(FoldedText(countryCode).view());
+        if (countryId < 0) {
+            return -1.0;
+        }
+        FoldedText foldedCity(cityName);
+        for (char c : foldedCity.view()) {
+            node = node->children.find(c);
+            if (!node) {
+                return -1.0;
+            }
+        }
+        if (!node->isEndOfWord) {
+            return -1.0;
+        }
+        const CountryPopulation* entry = node->findCountry(static_cast<uint16_t>(countryId));
+        if (!entry) {
+            return -1.0;
+        }
+        return entry->population;
+    }
+
+    // Same lockstep walk as FlatTrieView::searchMany: each round advances every pending
+    // lookup by one character and prefetches the child node it lands on. Each query's city
+    // and country are folded once into a scratch buffer shared by the batch; a cursor keeps
+    // the city's offsets and the resolved country id.
+    void searchMany(span<const CityQuery> queries, span<double> results) override {
+        struct Cursor {
+            const TrieNode* node;
+            uint32_t city;
+            uint32_t cityLength;
+            uint32_t depth;
+            int32_t countryId;
+        };
+        string scratch;
+        Cursor cursors[searchBatchWidth];
+        size_t active[searchBatchWidth];
+        for (size_t base = 0; base < queries.size(); base += searchBatchWidth) {
+            size_t count = min(searchBatchWidth, queries.size() - base);
+            size_t needed = 0;
+            for (size_t i = 0; i < count; ++i) {
+                needed += maxFoldedSize(queries[base + i].city.size()) + maxFoldedSize(queries[base + i].country.size());
+            }
+            if (scratch.size() < needed) {
+                scratch.resize(needed);
+            }
+            uint32_t used = 0;
+            size_t remaining = 0;
+            for (size_t i = 0; i < count; ++i) {
+                Cursor& cursor = cursors[i];
+                cursor.city = used;
+                cursor.cityLength = static_cast<uint32_t>(foldCase(queries[base + i].city, scratch.data() + used));
+                used += cursor.cityLength;
+                size_t countryLength = foldCase(queries[base + i].country, scratch.data() + used);
+                cursor.countryId = countries.find(string_view(scratch.data() + used, countryLength));
+                cursor.node = root;
+                cursor.depth = 0;
+                if (cursor.countryId < 0) {
+                    results[base + i] = -1.0;
+                    continue;
+                }
+                active[remaining++] = i;
+            }
+            while (remaining > 0) {
+                size_t kept = 0;
+                for (size_t a = 0; a < remaining; ++a) {
+                    Cursor& cursor = cursors[active[a]];
+                    double& result = results[base + active[a]];
+                    if (cursor.depth == cursor.cityLength) {
+                        const CountryPopulation* entry = cursor.node->isEndOfWord ? cursor.node->findCountry(static_cast<uint16_t>(cursor.countryId)) : nullptr;
+                        result = entry ? entry->population : -1.0;
+                        continue;
+                    }
+                    const TrieNode* next = cursor.node->children.find(scratch[cursor.city + cursor.depth]);
+                    if (!next) {
+                        result = -1.0;
+                        continue;
+                    }
+                    cursor.node = next;
+                    ++cursor.depth;
+                    prefetch(cursor.node);
+                    active[kept++] = active[a];
+                }
+                remaining = kept;
+            }
+        }
+    }
+
+    size_t memoryUsage() const override {
+        return nodeBytes(root) + tableBytes();
+    }
+
+    const CountryCodes& countryCodes() const {
+        return countries;
+    }
+
+    // Visits the nodes breadth-first, children in byte order of their labels, passing each
+    // node's child labels and its country payloads (sorted by country id).
+    template<typename Visit>
+    void walkBreadthFirst(Visit visit) const {
+        vector<const TrieNode*> queue = {root};
+        vector<pair<unsigned char, const TrieNode*>> children;
+        string childLabels;
+        for (size_t q = 0; q < queue.size(); ++q) {
+            const TrieNode* node = queue[q];
+            children.clear();
+            for (const auto& child : node->children) {
+                children.emplace_back(static_cast<unsigned char>(child.first), child.second);
+            }
+            sort(children.begin(), children.end());
+            childLabels.clear();
+            for (const auto& child : children) {
+                childLabels.push_back(static_cast<char>(child.first));
+                queue.push_back(child.second);
+            }
+            if (node->isEndOfWord) {
+                visit(string_view(childLabels), node->countriesBegin(), node->countriesEnd());
+            } else {
+                visit(string_view(childLabels), node->countriesEnd(), node->countriesEnd());
+            }
+        }
+    }
+
+    // Node, terminal and city counts, byte totals and the fan-out and depth histograms,
+    // from a single walk of the nodes.
+    TrieStats stats() const {
+        TrieStats result;
+        result.fanOut.resize(257);
+        collectStats(root, 0, result);
+        while (result.fanOut.size() > 1 && result.fanOut.back() == 0) {
+            result.fanOut.pop_back();
+        }
+        result.cities = cities->size() - freeIds.size();
+        result.totalBytes = result.nodeBytes + tableBytes();
+        return result;
+    }
+
+    size_t nodeCount() const override {
+        return countNodes(root);
+    }
+};
+
+struct RadixNode {
+    string label;
+    bool isEndOfWord;
+    StringMap<double> countryPopulation;
+    string childFirst;
+    vector<RadixNode*> children;
+    RadixNode() : isEndOfWord(false) {}
+};
+
+// Path-compressed NameTrie: every edge carries a whole name fragment, so single-child
+// chains collapse into one node and lookups compare segments with memcmp. Each node keeps
+// the first byte of every child label in childFirst so dispatch does not touch the children.
+class RadixNameTrie : public CityIndex {
+private:
+    RadixNode* root;
+
+    static void destroy(RadixNode* node) {
+        for (RadixNode* child : node->children) {
+            destroy(child);
+        }
+        delete node;
+    }
+
+    static size_t nodeBytes(const RadixNode* node) {
+        size_t bytes = sizeof(RadixNode);
+        if (node->label.capacity() > 15) {
+            bytes += node->label.capacity() + 1;
+        }
+        if (node->childFirst.capacity() > 15) {
+            bytes += node->childFirst.capacity() + 1;
+        }
+        bytes += node->children.capacity() * sizeof(RadixNode*);
+        bytes += node->countryPopulation.bucket_count() * sizeof(void*);
+        bytes += node->countryPopulation.size() * (sizeof(void*) + sizeof(size_t) + sizeof(pair<const string, double>));
+        for (const RadixNode* child : node->children) {
+            bytes += nodeBytes(child);
+        }
+        return bytes;
+    }
+
+    static size_t countNodes(const RadixNode* node) {
+        size_t count = 1;
+        for (const RadixNode* child : node->children) {
+            count += countNodes(child);
+        }
+        return count;
+    }
+
+public:
+    RadixNameTrie() {
+        root = new RadixNode();
+    }
+
+    ~RadixNameTrie() override {
+        destroy(root);
+    }
+
+    RadixNameTrie(const RadixNameTrie&) = delete;
+    RadixNameTrie& operator=(const RadixNameTrie&) = delete;
+
+    void insert(string_view cityName, string_view countryCode, double population) override {
+        RadixNode* node = root;
+        string lowerCity = toLower(cityName);
+        size_t pos = 0;
+        while (pos < lowerCity.size()) {
+            size_t slot = node->childFirst.find(lowerCity[pos]);
+            if (slot == string::npos) {
+                RadixNode* leaf = new RadixNode();
+                leaf->label = lowerCity.substr(pos);
+                node->childFirst.push_back(lowerCity[pos]);
+                node->children.push_back(leaf);
+                node = leaf;
+                break;
+            }
+            RadixNode* child = node->children[slot];
+            size_t common = 0;
+            while (common < child->label.size() && pos + common < lowerCity.size() &&
+                   child->label[common] == lowerCity[pos + common]) {
+                ++common;
+            }
+            if (common < child->label.size()) {
+                RadixNode* middle = new RadixNode();
+                middle->label = child->label.substr(0, common);
+                child->label.erase(0, common);
+                middle->childFirst.push_back(child->label[0]);
+                middle->children.push_back(child);
+                node->children[slot] = middle;
+                child = middle;
+            }
+            node = child;
+            pos += common;
+        }
+        node->isEndOfWord = true;
+        string lowerCountry = toLower(countryCode);
+        node->countryPopulation[lowerCountry] = population;
+    }
+
+    double search(string_view cityName, string_view countryCode) override {
+        const RadixNode* node = root;
+        FoldedText foldedCity(cityName);
+        FoldedText lowerCountry(countryCode);
+        string_view lowerCity = foldedCity.view();
+        size_t pos = 0;
+        while (pos < lowerCity.size()) {
+            size_t slot = node->childFirst.find(lowerCity[pos]);
+            if (slot == string::npos) {
+                return -1.0;
+            }
+            node = node->children[slot];
+            size_t length = node->label.size();
+            if (length > lowerCity.size() - pos || memcmp(node->label.data(), lowerCity.data() + pos, length) != 0) {
+                return -1.0;
+            }
+            pos += length;
+        }
+        if (!node->isEndOfWord) {
+            return -1.0;
+        }
+        auto it = node->countryPopulation.find(lowerCountry.view());
+        if (it == node->countryPopulation.end()) {
+            return -1.0;
+        }
+        return it->second;
+    }
+
+    size_t memoryUsage() const override {
+        return sizeof(RadixNameTrie) + nodeBytes(root);
+    }
+
+    size_t nodeCount() const override {
+        return countNodes(root);
+    }
+};
+
+struct FlatTrieNode {
+    uint32_t firstChild;
+    uint32_t firstPayload;
+    uint16_t childCount;
+    uint16_t payloadCount;
+};
+
+struct FlatTriePayload {
+    uint32_t countryOffset;
+    uint32_t countryLength;
+    double population;
+};
+
+// Non-owning view of the arrays that make up a flat trie. Everything is addressed by index
+// or offset, so the same view works over FlatNameTrie's vectors and over a mapped snapshot.
+struct FlatTrieView {
+    const FlatTrieNode* nodes;
+    const unsigned char* labels;
+    const FlatTriePayload* payloads;
+    const char* countryPool;
+
+    // Index of the child of node index labelled ch, or -1.
+    int64_t child(uint32_t index, char ch) const {
+        const FlatTrieNode& node = nodes[index];
+        const unsigned char* first = labels + node.firstChild;
+        const unsigned char* last = first + node.childCount;
+        const unsigned char* it = lower_bound(first, last, static_cast<unsigned char>(ch));
+        if (it == last || *it != static_cast<unsigned char>(ch)) {
+            return -1;
+        }
+        return it - labels;
+    }
+
+    double population(uint32_t index, string_view lowerCountry) const {
+        const FlatTrieNode& node = nodes[index];
+        for (uint32_t p = node.firstPayload; p < node.firstPayload + node.payloadCount; ++p) {
+            const FlatTriePayload& payload = payloads[p];
+            if (lowerCountry.size() == payload.countryLength &&
+                memcmp(countryPool + payload.countryOffset, lowerCountry.data(), payload.countryLength) == 0) {
+                return payload.population;
+            }
+        }
+        return -1.0;
+    }
+
+    double search(string_view cityName, string_view countryCode) const {
+        uint32_t index = 0;
+        FoldedText foldedCity(cityName);
+        for (char ch : foldedCity.view()) {
+            int64_t next = child(index, ch);
+            if (next < 0) {
+                return -1.0;
+            }
+            index = static_cast<uint32_t>(next);
+        }
+        return population(index, FoldedText(countryCode).view());
+    }
+
+    // Walks up to searchBatchWidth lookups in lockstep, one character per lookup per round,
+    // prefetching each lookup's next node so the misses of the whole group overlap. A batch
+    // folds its keys back to back into one scratch buffer, so each cursor is a few offsets
+    // and the group's cursors share a couple of cache lines.
+    void searchMany(span<const CityQuery> queries, span<double> results) const {
+        struct Cursor {
+            uint32_t city;
+            uint32_t cityLength;
+            uint32_t country;
+            uint32_t countryLength;
+            uint32_t index;
+            uint32_t depth;
+        };
+        string scratch;
+        Cursor cursors[searchBatchWidth];
+        size_t active[searchBatchWidth];
+        for (size_t base = 0; base < queries.size(); base += searchBatchWidth) {
+            size_t count = min(searchBatchWidth, queries.size() - base);
+            size_t needed = 0;
+            for (size_t i = 0; i < count; ++i) {
+                needed += maxFoldedSize(queries[base + i].city.size()) + maxFoldedSize(queries[base + i].country.size());
+            }
+            if (scratch.size() < needed) {
+                scratch.resize(needed);
+            }
+            uint32_t used = 0;
+            for (size_t i = 0; i < count; ++i) {
+                Cursor& cursor = cursors[i];
+                cursor.city = used;
+                cursor.cityLength = static_cast<uint32_t>(foldCase(queries[base + i].city, scratch.data() + used));
+                used += cursor.cityLength;
+                cursor.country = used;
+                cursor.countryLength = static_cast<uint32_t>(foldCase(queries[base + i].country, scratch.data() + used));
+                used += cursor.countryLength;
+                cursor.index = 0;
+                cursor.depth = 0;
+                active[i] = i;
+            }
+            size_t remaining = count;
+            while (remaining > 0) {
+                size_t kept = 0;
+                for (size_t a = 0; a < remaining; ++a) {
+                    Cursor& cursor = cursors[active[a]];
+                    if (cursor.depth == cursor.cityLength) {
+                        results[base + active[a]] = population(cursor.index, string_view(scratch.data() + cursor.country, cursor.countryLength));
+                        continue;
+                    }
+                    int64_t next = child(cursor.index, scratch[cursor.city + cursor.depth]);
+                    if (next < 0) {
+                        results[base + active[a]] = -1.0;
+                        continue;
+                    }
+                    cursor.index = static_cast<uint32_t>(next);
+                    ++cursor.depth;
+                    prefetch(&nodes[cursor.index]);
+                    active[kept++] = active[a];
+                }
+                remaining = kept;
+            }
+        }
+    }
+
+    // Rebuilds the row of payload p from the bottom up. BFS order hands out firstPayload and
+    // firstChild in increasing node order, so the payload's node and then each parent is the
+    // last of the nodeCount nodes whose range starts at or before it.
+    CityRow row(uint32_t p, uint32_t nodeCount) const {
+        const FlatTrieNode* last = nodes + nodeCount;
+        auto owner = upper_bound(nodes, last, p, [](uint32_t value, const FlatTrieNode& node) { return value < node.firstPayload; });
+        uint32_t index = static_cast<uint32_t>(owner - nodes - 1);
+        string city;
+        while (index != 0) {
+            city.push_back(static_cast<char>(labels[index]));
+            auto parent = upper_bound(nodes, last, index, [](uint32_t value, const FlatTrieNode& node) { return value < node.firstChild; });
+            index = static_cast<uint32_t>(parent - nodes - 1);
+        }
+        reverse(city.begin(), city.end());
+        return {std::move(city), string(countryPool + payloads[p].countryOffset, payloads[p].countryLength), payloads[p].population};
+    }
+
+    void collect(uint32_t index, string& prefix, vector<CityRow>& out) const {
+        const FlatTrieNode& node = nodes[index];
+        for (uint32_t p = node.firstPayload; p < node.firstPayload + node.payloadCount; ++p) {
+            out.push_back({prefix, string(countryPool + payloads[p].countryOffset, payloads[p].countryLength), payloads[p].population});
+        }
+        for (uint32_t c = node.firstChild; c < node.firstChild + node.childCount; ++c) {
+            prefix.push_back(static_cast<char>(labels[c]));
+            collect(c, prefix, out);
+            prefix.pop_back();
+        }
+    }
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nodeCount;
+    uint32_t payloadCount;
+    uint32_t countryPoolSize;
+    uint64_t nodesOffset;
+    uint64_t labelsOffset;
+    uint64_t payloadsOffset;
+    uint64_t countryPoolOffset;
+    uint64_t fileSize;
+};
+
+const char snapshotMagic[8] = {'C', 'I', 'T', 'Y', 'T', 'R', 'I', 'E'};
+const uint32_t snapshotVersion = 2;
+
+// Read-optimised trie: nodes live in one array in BFS order, and the children of a node
+// occupy the contiguous index range [firstChild, firstChild + childCount) with their edge
+// labels sorted in a parallel byte array. Inserts are staged and the layout is rebuilt on
+// the next search.
+class FlatNameTrie : public CityIndex {
+private:
+    vector<FlatTrieNode> nodes;
+    vector<unsigned char> labels;
+    vector<FlatTriePayload> payloads;
+    string countryPool;
+    vector<CityRow> pending;
+
+    FlatTrieView view() const {
+        return {nodes.data(), labels.data(), payloads.data(), countryPool.data()};
+    }
+
+    void build() {
+        vector<CityRow> entries;
+        if (!nodes.empty()) {
+            string prefix;
+            view().collect(0, prefix, entries);
+        }
+        for (CityRow& e : pending) {
+            entries.push_back(std::move(e));
+        }
+        pending.clear();
+        pending.shrink_to_fit();
+
+        // Later inserts overwrite earlier ones, so keep the last entry of each (city, country) pair.
+        stable_sort(entries.begin(), entries.end(), [](const CityRow& a, const CityRow& b) {
+            if (a.city != b.city) return a.city < b.city;
+            return a.country < b.country;
+        });
+        vector<CityRow> unique;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (i + 1 < entries.size() && entries[i + 1].city == entries[i].city && entries[i + 1].country == entries[i].country) {
+                continue;
+            }
+            unique.push_back(std::move(entries[i]));
+        }
+
+        nodes.assign(1, {0, 0, 0, 0});
+        labels.assign(1, 0);
+        payloads.clear();
+        countryPool.clear();
+        unordered_map<string, uint32_t> countryOffsets;
+
+        struct Range { uint32_t node; size_t lo; size_t hi; size_t depth; };
+        vector<Range> queue = {{0, 0, unique.size(), 0}};
+        for (size_t q = 0; q < queue.size(); ++q) {
+            Range r = queue[q];
+            size_t i = r.lo;
+            nodes[r.node].firstPayload = static_cast<uint32_t>(payloads.size());
+            while (i < r.hi && unique[i].city.size() == r.depth) {
+                auto it = countryOffsets.find(unique[i].country);
+                if (it == countryOffsets.end()) {
+                    it = countryOffsets.emplace(unique[i].country, static_cast<uint32_t>(countryPool.size())).first;
+                    countryPool += unique[i].country;
+                }
+                payloads.push_back({it->second, static_cast<uint32_t>(unique[i].country.size()), unique[i].population});
+                ++i;
+            }
+            nodes[r.node].payloadCount = static_cast<uint16_t>(payloads.size() - nodes[r.node].firstPayload);
+            nodes[r.node].firstChild = static_cast<uint32_t>(nodes.size());
+            while (i < r.hi) {
+                unsigned char c = static_cast<unsigned char>(unique[i].city[r.depth]);
+                size_t j = i;
+                while (j < r.hi && static_cast<unsigned char>(unique[j].city[r.depth]) == c) {
+                    ++j;
+                }
+                uint32_t child = static_cast<uint32_t>(nodes.size());
+                nodes.push_back({0, 0, 0, 0});
+                labels.push_back(c);
+                queue.push_back({child, i, j, r.depth + 1});
+                i = j;
+            }
+            nodes[r.node].childCount = static_cast<uint16_t>(nodes.size() - nodes[r.node].firstChild);
+        }
+        nodes.shrink_to_fit();
+        labels.shrink_to_fit();
+        payloads.shrink_to_fit();
+        countryPool.shrink_to_fit();
+    }
+
+public:
+    void insert(string_view cityName, string_view countryCode, double population) override {
+        pending.push_back({toLower(cityName), toLower(countryCode), population});
+    }
+
+    void finalize() override {
+        if (!pending.empty() || nodes.empty()) {
+            build();
+        }
+    }
+
+    double search(string_view cityName, string_view countryCode) override {
+        finalize();
+        return view().search(cityName, countryCode);
+    }
+
+    void searchMany(span<const CityQuery> queries, span<double> results) override {
+        finalize();
+        if (nodes.size() * sizeof(FlatTrieNode) < flatBatchMinNodeBytes) {
+            CityIndex::searchMany(queries, results);
+            return;
+        }
+        view().searchMany(queries, results);
+    }
+
+    size_t memoryUsage() const override {
+        return sizeof(FlatNameTrie) + nodes.capacity() * sizeof(FlatTrieNode) + labels.capacity() +
+               payloads.capacity() * sizeof(FlatTriePayload) + countryPool.capacity() + pending.capacity() * sizeof(CityRow);
+    }
+
+    size_t nodeCount() const override {
+        return nodes.size();
+    }
+
+    // Writes the finished layout as a position-independent snapshot: a header of section
+    // offsets followed by the node, label, payload and country-pool arrays, each 8-byte aligned.
+    bool saveSnapshot(const string& path) {
+        finalize();
+        auto align = [](uint64_t offset) { return (offset + 7) & ~uint64_t(7); };
+        SnapshotHeader header{};
+        memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+        header.version = snapshotVersion;
+        header.nodeCount = static_cast<uint32_t>(nodes.size());
+        header.payloadCount = static_cast<uint32_t>(payloads.size());
+        header.countryPoolSize = static_cast<uint32_t>(countryPool.size());
+        header.nodesOffset = align(sizeof(SnapshotHeader));
+        header.labelsOffset = align(header.nodesOffset + nodes.size() * sizeof(FlatTrieNode));
+        header.payloadsOffset = align(header.labelsOffset + labels.size());
+        header.countryPoolOffset = align(header.payloadsOffset + payloads.size() * sizeof(FlatTriePayload));
+        header.fileSize = header.countryPoolOffset + countryPool.size();
+
+        ofstream out(path, ios::binary | ios::trunc);
+        if (!out.is_open()) {
+            cerr << "Error opening file " << path << endl;
+            return false;
+        }
+        auto writeAt = [&](uint64_t offset, const void* data, size_t size) {
+            static const char zeros[8] = {};
+            out.write(zeros, static_cast<streamsize>(offset - static_cast<uint64_t>(out.tellp())));
+            out.write(static_cast<const char*>(data), static_cast<streamsize>(size));
+        };
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        writeAt(header.nodesOffset, nodes.data(), nodes.size() * sizeof(FlatTrieNode));
+        writeAt(header.labelsOffset, labels.data(), labels.size());
+        writeAt(header.payloadsOffset, payloads.data(), payloads.size() * sizeof(FlatTriePayload));
+        writeAt(header.countryPoolOffset, countryPool.data(), countryPool.size());
+        return out.good();
+    }
+};
+
+class MappedFile {
+private:
+    const char* base;
+    size_t length;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+    // Set when open() found a pipe, FIFO or device rather than a regular file.
+    bool stream = false;
+
+    void close() {
+#ifdef _WIN32
+        if (base) UnmapViewOfFile(base);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+        mapping = nullptr;
+#else
+        if (base) munmap(const_cast<char*>(base), length);
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+        base = nullptr;
+        length = 0;
+        stream = false;
+    }
+
+public:
+#ifdef _WIN32
+    MappedFile() : base(nullptr), length(0), file(INVALID_HANDLE_VALUE), mapping(nullptr) {}
+#else
+    MappedFile() : base(nullptr), length(0), fd(-1) {}
+#endif
+
+    ~MappedFile() {
+        close();
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const string& path) {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        if (GetFileType(file) != FILE_TYPE_DISK) {
+            stream = true;
+            return false;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+            close();
+            return false;
+        }
+        length = static_cast<size_t>(size.QuadPart);
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        base = mapping ? static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+#else
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close();
+            return false;
+        }
+        if (!S_ISREG(info.st_mode)) {
+            stream = true;
+            return false;
+        }
+        if (info.st_size == 0) {
+            close();
+            return false;
+        }
+        length = static_cast<size_t>(info.st_size);
+        void* mapped = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        base = mapped == MAP_FAILED ? nullptr : static_cast<const char*>(mapped);
+#endif
+        if (!base) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    // After open() turned down a pipe, FIFO or device, hands over the descriptor it left
+    // open, which the caller then closes; -1 otherwise. Reopening such a path would block
+    // waiting for a new writer, or find the data the first open already took.
+    int releaseStream() {
+        if (!stream) {
+            return -1;
+        }
+        stream = false;
+#ifdef _WIN32
+        int handed = _open_osfhandle(reinterpret_cast<intptr_t>(file), _O_RDONLY | _O_BINARY);
+        if (handed >= 0) {
+            file = INVALID_HANDLE_VALUE;
+        }
+#else
+        int handed = fd;
+        fd = -1;
+#endif
+        return handed;
+    }
+
+    const char* data() const {
+        return base;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    // Hints that the mapping will be read front to back, so the kernel reads ahead further.
+    void adviseSequential() const {
+#ifndef _WIN32
+        if (base) {
+            madvise(const_cast<char*>(base), length, MADV_SEQUENTIAL);
+        }
+#endif
+    }
+};
+
+// Serves a snapshot written by FlatNameTrie::saveSnapshot straight out of the page cache:
+// open() validates the header and the node table and points a FlatTrieView at the mapping,
+// with no copying, so processes mapping the same file share its pages.
+class MappedNameTrie : public CityIndex {
+private:
+    MappedFile file;
+    FlatTrieView trieView{};
+    uint32_t nodes = 0;
+    uint32_t payloadCount = 0;
+
+    // One pass over the node and payload tables, so lookups can trust every index they
+    // follow. build() lays nodes out in BFS order: node i's children follow those of nodes
+    // before it and come after i itself, and its payloads follow theirs likewise. Checking
+    // that exact layout also rules out cycles and the overlapping ranges row() cannot search.
+    bool validLayout(const SnapshotHeader& header) const {
+        uint64_t nextChild = 1, nextPayload = 0;
+        for (uint32_t i = 0; i < header.nodeCount; ++i) {
+            const FlatTrieNode& node = trieView.nodes[i];
+            if (node.firstChild != nextChild || node.firstPayload != nextPayload ||
+                (node.childCount > 0 && node.firstChild <= i)) {
+                return false;
+            }
+            nextChild += node.childCount;
+            nextPayload += node.payloadCount;
+        }
+        if (nextChild != header.nodeCount || nextPayload != header.payloadCount) {
+            return false;
+        }
+        for (uint32_t p = 0; p < header.payloadCount; ++p) {
+            const FlatTriePayload& payload = trieView.payloads[p];
+            if (uint64_t(payload.countryOffset) + payload.countryLength > header.countryPoolSize) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    bool open(const string& path) {
+        if (!file.open(path)) {
+            cerr << "Error opening file " << path << endl;
+            return false;
+        }
+        SnapshotHeader header;
+        if (file.size() < sizeof(header)) {
+            cerr << "Snapshot " << path << " is truncated" << endl;
+            return false;
+        }
+        memcpy(&header, file.data(), sizeof(header));
+        if (memcmp(header.magic, snapshotMagic, sizeof(header.magic)) != 0 || header.version != snapshotVersion ||
+            header.fileSize != file.size() || header.nodeCount == 0 || header.nodesOffset < sizeof(header) ||
+            header.countryPoolOffset > header.fileSize || header.nodesOffset % alignof(FlatTrieNode) != 0 ||
+            header.payloadsOffset % alignof(FlatTriePayload) != 0 ||
+            header.nodesOffset + uint64_t(header.nodeCount) * sizeof(FlatTrieNode) > header.labelsOffset ||
+            header.labelsOffset + header.nodeCount > header.payloadsOffset ||
+            header.payloadsOffset + uint64_t(header.payloadCount) * sizeof(FlatTriePayload) > header.countryPoolOffset ||
+            header.countryPoolOffset + header.countryPoolSize > header.fileSize) {
+            cerr << "Snapshot " << path << " is not a valid city trie snapshot" << endl;
+            return false;
+        }
+        const char* base = file.data();
+        trieView = {reinterpret_cast<const FlatTrieNode*>(base + header.nodesOffset),
+                    reinterpret_cast<const unsigned char*>(base + header.labelsOffset),
+                    reinterpret_cast<const FlatTriePayload*>(base + header.payloadsOffset),
+                    base + header.countryPoolOffset};
+        if (!validLayout(header)) {
+            cerr << "Snapshot " << path << " is not a valid city trie snapshot" << endl;
+            return false;
+        }
+        nodes = header.nodeCount;
+        payloadCount = header.payloadCount;
+        return true;
+    }
+
+    void insert(string_view, string_view, double) override {
+        throw logic_error("mapped snapshots are read-only");
+    }
+
+    double search(string_view cityName, string_view countryCode) override {
+        return trieView.search(cityName, countryCode);
+    }
+
+    void searchMany(span<const CityQuery> queries, span<double> results) override {
+        if (nodes * sizeof(FlatTrieNode) < flatBatchMinNodeBytes) {
+            CityIndex::searchMany(queries, results);
+            return;
+        }
+        trieView.searchMany(queries, results);
+    }
+
+    // The mapping is file-backed and shared, so only the handle itself is private memory.
+    size_t memoryUsage() const override {
+        return sizeof(MappedNameTrie);
+    }
+
+    size_t nodeCount() const override {
+        return nodes;
+    }
+
+    vector<CityRow> rows() const {
+        vector<CityRow> out;
+        string prefix;
+        trieView.collect(0, prefix, out);
+        return out;
+    }
+
+    // Adds up to count distinct rows, drawn uniformly with Floyd's algorithm, to out. Each
+    // costs a couple of binary searches per character rather than a walk of the whole trie.
+    void sampleRows(size_t count, CityTable& out, mt19937_64& rng) const {
+        vector<uint32_t> picked;
+        if (count >= payloadCount) {
+            picked.resize(payloadCount);
+            iota(picked.begin(), picked.end(), 0);
+        } else {
+            unordered_set<uint32_t> seen;
+            for (uint32_t j = static_cast<uint32_t>(payloadCount - count); j < payloadCount; ++j) {
+                uint32_t p = uniform_int_distribution<uint32_t>(0, j)(rng);
+                if (!seen.insert(p).second) {
+                    p = j;
+                    seen.insert(j);
+                }
+                picked.push_back(p);
+            }
+        }
+        for (uint32_t p : picked) {
+            CityRow row = trieView.row(p, nodes);
+            out.add(row.city, row.country, row.population);
+        }
+    }
+};
+
+// A cached lookup. The city is a CityTable id rather than copies of its names, and key
+// views the string owned by the cache's own map, so each key is stored once.
+struct CacheEntry {
+    string_view key;
+    uint32_t cityId;
+    double population;
+};
+
+class Cache {
+public:
+    virtual ~Cache() = default;
+    virtual bool get(string_view key, double &population) = 0;
+    virtual void put(string_view key, uint32_t cityId, double population) = 0;
+    virtual void erase(string_view key) = 0;
+    virtual void clear() = 0;
+    virtual void printCache(const CityTable& table) const = 0;
+};
+
+class LFUCache : public Cache {
+private:
+    struct Node {
+        uint32_t cityId;
+        double population;
+        int freq;
+        list<string_view>::iterator freq_it;
+    };
+
+    int capacity;
+    int min_freq;
+    StringMap<Node> key_map;
+    // Keys per frequency, viewing the strings owned by key_map.
+    unordered_map<int, list<string_view>> freq_map;
+
+public:
+    LFUCache(int cap) : capacity(cap), min_freq(0) {}
+
+    bool get(string_view key, double &population) override {
+        auto it = key_map.find(key);
+        if (it == key_map.end()) {
+            return false;
+        }
+
+        Node &node = it->second;
+        int old_freq = node.freq;
+        node.freq++;
+        population = node.population;
+
+        // Move the key's list node instead of erasing and re-inserting a copy, and when it was
+        // alone at its old frequency, relabel that level rather than allocate a new one.
+        auto old_level = freq_map.find(old_freq);
+        auto new_level = freq_map.find(node.freq);
+        if (new_level == freq_map.end() && old_level->second.size() == 1) {
+            auto level = freq_map.extract(old_level);
+            level.key() = node.freq;
+            freq_map.insert(std::move(level));
+        } else {
+            if (new_level == freq_map.end()) {
+                new_level = freq_map.emplace(node.freq, list<string_view>()).first;
+            }
+            new_level->second.splice(new_level->second.begin(), old_level->second, node.freq_it);
+            if (old_level->second.empty()) {
+                freq_map.erase(old_level);
+            }
+        }
+        if (old_freq == min_freq && freq_map.find(old_freq) == freq_map.end()) {
+            min_freq++;
+        }
+        return true;
+    }
+
+    void put(string_view key, uint32_t cityId, double population) override {
+        if (capacity <= 0) return;
+
+        auto it = key_map.find(key);
+        if (it != key_map.end()) {
+            Node &node = it->second;
+            node.population = population;
+            node.cityId = cityId;
+            double dummy;
+            get(key, dummy);
+            return;
+        }
+
+        if (key_map.size() >= capacity) {
+            auto evicted = key_map.find(freq_map[min_freq].back());
+            freq_map[min_freq].pop_back();
+            key_map.erase(evicted);
+
+            if (freq_map[min_freq].empty()) {
+                freq_map.erase(min_freq);
+            }
+        }
+
+        min_freq = 1;
+        it = key_map.emplace(string(key), Node{cityId, population, 1, {}}).first;
+        freq_map[min_freq].push_front(it->first);
+        it->second.freq_it = freq_map[min_freq].begin();
+    }
+
+    void erase(string_view key) override {
+        auto it = key_map.find(key);
+        if (it == key_map.end()) {
+            return;
+        }
+        auto level = freq_map.find(it->second.freq);
+        level->second.erase(it->second.freq_it);
+        if (level->second.empty()) {
+            freq_map.erase(level);
+        }
+        key_map.erase(it);
+        // put() evicts from freq_map[min_freq], so it must name a level that still exists.
+        if (freq_map.find(min_freq) == freq_map.end()) {
+            min_freq = 0;
+            for (const auto &entry : freq_map) {
+                if (min_freq == 0 || entry.first < min_freq) {
+                    min_freq = entry.first;
+                }
+            }
+        }
+    }
+
+    void clear() override {
+        key_map.clear();
+        freq_map.clear();
+        min_freq = 0;
+    }
+
+    void printCache(const CityTable& table) const override {
+        cout << "\n--------- Current LFU Cache ---------\n";
+        for (const auto &pair : key_map) {
+            const Node &node = pair.second;
+            cout << "City: " << table.city(node.cityId) << ", Country: " << table.country(node.cityId) << ", Population: " << node.population << ", Freq: " << node.freq << "\n";
+        }
+        cout << "-------------------------------------\n";
+    }
+};
+
+class FIFOCache : public Cache {
+private:
+    list<CacheEntry> entries;
+    StringMap<list<CacheEntry>::iterator> cacheMap;
+    int capacity;
+
+public:
+    FIFOCache(int cap) : capacity(cap) {}
+
+    bool get(string_view key, double &population) override {
+        auto it = cacheMap.find(key);
+        if (it == cacheMap.end()) {
+            return false;
+        }
+        population = it->second->population;
+        return true;
+    }
+
+    void put(string_view key, uint32_t cityId, double population) override {
+        auto it = cacheMap.find(key);
+        if (it != cacheMap.end()) {
+            it->second->population = population;
+            return;
+        }
+
+        if (entries.size() >= capacity) {
+            cacheMap.erase(cacheMap.find(entries.front().key));
+            entries.pop_front();
+        }
+
+        it = cacheMap.emplace(string(key), entries.end()).first;
+        entries.push_back({it->first, cityId, population});
+        it->second = --entries.end();
+    }
+
+    void erase(string_view key) override {
+        auto it = cacheMap.find(key);
+        if (it == cacheMap.end()) {
+            return;
+        }
+        entries.erase(it->second);
+        cacheMap.erase(it);
+    }
+
+    void clear() override {
+        entries.clear();
+        cacheMap.clear();
+    }
+
+    void printCache(const CityTable& table) const override {
+        cout << "\n--------- Current FIFO Cache ---------\n";
+        for (const CacheEntry &entry : entries) {
+            cout << "City: " << table.city(entry.cityId) << ", Country: " << table.country(entry.cityId) << ", Population: " << entry.population << "\n";
+        }
+        cout << "--------------------------------------\n";
+    }
+};
+
+class RandomCache : public Cache {
+private:
+    vector<CacheEntry> entries;
+    StringMap<size_t> keyMap;
+    int capacity;
+
+public:
+    RandomCache(int cap) : capacity(cap) { srand(time(0)); }
+
+    bool get(string_view key, double &population) override {
+        auto it = keyMap.find(key);
+        if (it == keyMap.end())
+            return false;
+        population = entries[it->second].population;
+        return true;
+    }
+
+    void put(string_view key, uint32_t cityId, double population) override {
+        auto it = keyMap.find(key);
+        if (it != keyMap.end()) {
+            entries[it->second] = {it->first, cityId, population};
+            return;
+        }
+
+        if (entries.size() >= capacity) {
+            int index = rand() % entries.size();
+            auto evicted = keyMap.find(entries[index].key);
+
+            if (index != entries.size() - 1) {
+                entries[index] = entries.back();
+                keyMap.find(entries[index].key)->second = index;
+            }
+
+            entries.pop_back();
+            keyMap.erase(evicted);
+        }
+
+        it = keyMap.emplace(string(key), entries.size()).first;
+        entries.push_back({it->first, cityId, population});
+    }
+
+    void erase(string_view key) override {
+        auto it = keyMap.find(key);
+        if (it == keyMap.end()) {
+            return;
+        }
+        size_t index = it->second;
+        keyMap.erase(it);
+        if (index != entries.size() - 1) {
+            entries[index] = entries.back();
+            keyMap.find(entries[index].key)->second = index;
+        }
+        entries.pop_back();
+    }
+
+    void clear() override {
+        entries.clear();
+        keyMap.clear();
+    }
+
+    void printCache(const CityTable& table) const override {
+        cout << "\n------- Current Random Cache --------\n";
+        for (const CacheEntry &entry : entries) {
+            cout << "City: " << table.city(entry.cityId) << ", Country: " << table.country(entry.cityId)
+                 << ", Population: " << entry.population << "\n";
+        }
+        cout << "-------------------------------------\n";
+    }
+};
+
+// Read-only exact-match index over normalised "country|city" keys, built on a CHD-style
+// minimal perfect hash: keys are grouped into small buckets, and each bucket stores the
+// pilot that displaces all of its keys into free slots of a table with exactly one slot per
+// key. Every slot also keeps a 32-bit fingerprint of its key, so absent keys are rejected
+// with probability 1 - 2^-32 without storing the keys themselves.
+class PerfectHashIndex : public CityIndex {
+private:
+    static constexpr double keysPerBucket = 4.0;
+    static constexpr uint32_t maxPilot = 1u << 24;
+
+    struct Slot {
+        uint32_t fingerprint;
+        double population;
+    };
+
+    struct KeyHash {
+        uint64_t bucket;
+        uint64_t position;
+        uint32_t fingerprint;
+    };
+
+    vector<uint32_t> pilots;
+    vector<Slot> slots;
+    uint64_t seed = 0;
+    vector<CityRow> pending;
+
+    static uint64_t mix(uint64_t x) {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    // Hashes an already case-folded "country|city" key.
+    static KeyHash hashKey(string_view key, uint64_t seed) {
+        uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+        for (char c : key) {
+            h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3ULL;
+        }
+        return {mix(h), mix(h ^ 0x9e3779b97f4a7c15ULL), static_cast<uint32_t>(mix(h ^ 0x632be59bd9b4e019ULL))};
+    }
+
+    static uint64_t slotFor(const KeyHash& hash, uint32_t pilot, size_t slotCount) {
+        return mix(hash.position ^ (pilot * 0x9e3779b97f4a7c15ULL)) % slotCount;
+    }
+
+    bool tryBuild(const vector<KeyHash>& hashes, const vector<double>& populations) {
+        size_t n = hashes.size();
+        size_t bucketCount = max<size_t>(1, static_cast<size_t>(n / keysPerBucket));
+        vector<vector<uint32_t>> buckets(bucketCount);
+        for (uint32_t i = 0; i < n; ++i) {
+            buckets[hashes[i].bucket % bucketCount].push_back(i);
+        }
+        vector<uint32_t> order(bucketCount);
+        iota(order.begin(), order.end(), 0);
+        stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return buckets[a].size() > buckets[b].size(); });
+
+        pilots.assign(bucketCount, 0);
+        slots.assign(n, {0, 0.0});
+        vector<bool> taken(n, false);
+        vector<uint64_t> positions;
+        for (uint32_t b : order) {
+            const vector<uint32_t>& keys = buckets[b];
+            if (keys.empty()) {
+                break;
+            }
+            uint32_t pilot = 0;
+            for (; pilot < maxPilot; ++pilot) {
+                positions.clear();
+                bool fits = true;
+                for (uint32_t k : keys) {
+                    uint64_t position = slotFor(hashes[k], pilot, n);
+                    if (taken[position] || find(positions.begin(), positions.end(), position) != positions.end()) {
+                        fits = false;
+                        break;
+                    }
+                    positions.push_back(position);
+                }
+                if (fits) {
+                    break;
+                }
+            }
+            if (pilot == maxPilot) {
+                return false;
+            }
+            pilots[b] = pilot;
+            for (size_t i = 0; i < keys.size(); ++i) {
+                taken[positions[i]] = true;
+                slots[positions[i]] = {hashes[keys[i]].fingerprint, populations[keys[i]]};
+            }
+        }
+        return true;
+    }
+
+    void build() {
+        // Later inserts overwrite earlier ones, as in NameTrie.
+        unordered_map<string, double> latest;
+        for (const CityRow& row : pending) {
+            latest[toLower(row.country) + "|" + toLower(row.city)] = row.population;
+        }
+        pending.clear();
+        pending.shrink_to_fit();
+
+        vector<string> keys;
+        vector<double> populations;
+        for (auto& entry : latest) {
+            keys.push_back(entry.first);
+            populations.push_back(entry.second);
+        }
+        for (seed = 0;; ++seed) {
+            vector<KeyHash> hashes;
+            for (const string& key : keys) {
+                hashes.push_back(hashKey(key, seed));
+            }
+            if (tryBuild(hashes, populations)) {
+                break;
+            }
+        }
+    }
+
+public:
+    // All rows must be inserted before the first search; the table cannot grow afterwards.
+    void insert(string_view cityName, string_view countryCode, double population) override {
+        if (!slots.empty()) {
+            throw logic_error("perfect hash index is read-only once built");
+        }
+        pending.push_back({string(cityName), string(countryCode), population});
+    }
+
+    void finalize() override {
+        if (slots.empty() && !pending.empty()) {
+            build();
+        }
+    }
+
+    double search(string_view cityName, string_view countryCode) override {
+        finalize();
+        if (slots.empty()) {
+            return -1.0;
+        }
+        KeyHash hash = hashKey(FoldedText(countryCode, '|', cityName).view(), seed);
+        const Slot& slot = slots[slotFor(hash, pilots[hash.bucket % pilots.size()], slots.size())];
+        return slot.fingerprint == hash.fingerprint ? slot.population : -1.0;
+    }
+
+    size_t memoryUsage() const override {
+        return sizeof(PerfectHashIndex) + pilots.capacity() * sizeof(uint32_t) + slots.capacity() * sizeof(Slot) +
+               pending.capacity() * sizeof(CityRow);
+    }
+
+    size_t nodeCount() const override {
+        return slots.size();
+    }
+};
+
+// Append-only bit vector with constant-time rank and near-constant-time select0. One
+// cumulative count per 512-bit block (32 bits, about 6% of the bits) serves rank1, and the
+// block holding every 512th zero is sampled so select0 starts next to its answer.
+class SuccinctBits {
+private:
+    static constexpr size_t blockWords = 8;
+    static constexpr size_t blockBits = 64 * blockWords;
+    static constexpr size_t zeroSampleRate = 512;
+
+    vector<uint64_t> words;
+    vector<uint32_t> blockRanks;
+    vector<uint32_t> zeroSamples;
+    size_t bitCount = 0;
+
+    size_t zerosBeforeBlock(size_t block) const {
+        return block * blockBits - blockRanks[block];
+    }
+
+    // Position of the k-th (0-based) zero bit within one word.
+    static size_t selectZeroInWord(uint64_t word, size_t k) {
+        uint64_t zeros = ~word;
+#ifdef __BMI2__
+        return countr_zero(_pdep_u64(1ULL << k, zeros));
+#else
+        for (size_t i = 0; i < k; ++i) {
+            zeros &= zeros - 1;
+        }
+        return countr_zero(zeros);
+#endif
+    }
+
+public:
+    void push(bool bit) {
+        if (bitCount % 64 == 0) {
+            words.push_back(0);
+        }
+        words.back() |= static_cast<uint64_t>(bit) << (bitCount % 64);
+        ++bitCount;
+    }
+
+    // Builds the rank and select directories; call once after the last push().
+    void finish() {
+        words.resize((words.size() + blockWords - 1) / blockWords * blockWords + blockWords);
+        blockRanks.assign(words.size() / blockWords, 0);
+        size_t ones = 0;
+        size_t zeros = 0;
+        for (size_t b = 0; b < blockRanks.size(); ++b) {
+            blockRanks[b] = static_cast<uint32_t>(ones);
+            for (size_t w = b * blockWords; w < (b + 1) * blockWords; ++w) {
+                size_t valid = w * 64 >= bitCount ? 0 : min<size_t>(64, bitCount - w * 64);
+                size_t wordZeros = valid - popcount(words[w]);
+                while (zeroSamples.size() * zeroSampleRate < zeros + wordZeros) {
+                    zeroSamples.push_back(static_cast<uint32_t>(b));
+                }
+                ones += popcount(words[w]);
+                zeros += wordZeros;
+            }
+        }
+        words.shrink_to_fit();
+    }
+
+    bool operator[](size_t i) const {
+        return (words[i / 64] >> (i % 64)) & 1;
+    }
+
+    // Ones in [0, i).
+    size_t rank1(size_t i) const {
+        size_t block = i / blockBits;
+        size_t rank = blockRanks[block];
+        for (size_t w = block * blockWords; w < i / 64; ++w) {
+            rank += popcount(words[w]);
+        }
+        if (i % 64) {
+            rank += popcount(words[i / 64] & ((1ULL << (i % 64)) - 1));
+        }
+        return rank;
+    }
+
+    // Position of the k-th (0-based) zero; k must be below the number of zeros.
+    size_t select0(size_t k) const {
+        size_t block = zeroSamples[k / zeroSampleRate];
+        while (block + 1 < blockRanks.size() && zerosBeforeBlock(block + 1) <= k) {
+            ++block;
+        }
+        k -= zerosBeforeBlock(block);
+        size_t w = block * blockWords;
+        for (;; ++w) {
+            size_t wordZeros = 64 - popcount(words[w]);
+            if (k < wordZeros) {
+                break;
+            }
+            k -= wordZeros;
+        }
+        return w * 64 + selectZeroInWord(words[w], k);
+    }
+
+    // Position of the first zero at or after i; the padding guarantees there is one.
+    size_t nextZero(size_t i) const {
+        size_t w = i / 64;
+        uint64_t zeros = ~words[w] & (~0ULL << (i % 64));
+        while (zeros == 0) {
+            zeros = ~words[++w];
+        }
+        return w * 64 + countr_zero(zeros);
+    }
+
+    size_t size() const {
+        return bitCount;
+    }
+
+    size_t memoryUsage() const {
+        return words.capacity() * sizeof(uint64_t) + (blockRanks.capacity() + zeroSamples.capacity()) * sizeof(uint32_t);
+    }
+};
+
+// Read-only succinct encoding of a NameTrie. The shape is a LOUDS bit string: nodes in
+// breadth-first order, each written as one 1 per child followed by a 0. Node x's block then
+// starts right after the x-th zero, and the j-th 1 overall is the edge to node j + 1, so
+// children are found with one select0 and no pointers. Edge labels sit in a byte array
+// indexed by edge, and a terminal bit per node ranks into the parallel payload arrays.
+// Rows inserted directly are staged in a NameTrie and encoded on finalize().
+class LoudsNameTrie : public CityIndex {
+private:
+    SuccinctBits shape;
+    SuccinctBits terminal;
+    vector<unsigned char> labels;
+    vector<uint32_t> payloadStart;
+    vector<uint16_t> payloadCountries;
+    vector<double> payloadPopulations;
+    CountryCodes countries;
+    unique_ptr<NameTrie> staging;
+    size_t nodes = 0;
+
+    // Child of node labelled ch, or -1.
+    int64_t child(size_t node, unsigned char ch) const {
+        size_t start = node == 0 ? 0 : shape.select0(node - 1) + 1;
+        size_t degree = shape.nextZero(start) - start;
+        size_t firstEdge = start - node;
+        const unsigned char* first = labels.data() + firstEdge;
+        const void* found = memchr(first, ch, degree);
+        return found ? static_cast<int64_t>(static_cast<const unsigned char*>(found) - labels.data()) + 1 : -1;
+    }
+
+public:
+    void build(const NameTrie& trie) {
+        countries = trie.countryCodes();
+        nodes = 0;
+        trie.walkBreadthFirst([&](string_view childLabels, const CountryPopulation* first, const CountryPopulation* last) {
+            for (char c : childLabels) {
+                shape.push(true);
+                labels.push_back(static_cast<unsigned char>(c));
+            }
+            shape.push(false);
+            terminal.push(first != last);
+            if (first != last) {
+                payloadStart.push_back(static_cast<uint32_t>(payloadCountries.size()));
+                for (; first != last; ++first) {
+                    payloadCountries.push_back(first->countryId);
+                    payloadPopulations.push_back(first->population);
+                }
+            }
+            ++nodes;
+        });
+        payloadStart.push_back(static_cast<uint32_t>(payloadCountries.size()));
+        shape.finish();
+        terminal.finish();
+        labels.shrink_to_fit();
+        payloadStart.shrink_to_fit();
+        payloadCountries.shrink_to_fit();
+        payloadPopulations.shrink_to_fit();
+    }
+
+    void insert(string_view cityName, string_view countryCode, double population) override {
+        if (nodes != 0) {
+            throw logic_error("LOUDS trie is read-only once built");
+        }
+        if (!staging) {
+            staging = make_unique<NameTrie>();
+        }
+        staging->insert(cityName, countryCode, population);
+    }
+
+    void finalize() override {
+        if (staging) {
+            build(*staging);
+            staging.reset();
+        }
+    }
+
+    double search(string_view cityName, string_view countryCode) override {
+        finalize();
+        int countryId = countries.find(FoldedText(countryCode).view());
+        if (countryId < 0 || nodes == 0) {
+            return -1.0;
+        }
+        size_t node = 0;
+        FoldedText foldedCity(cityName);
+        for (char c : foldedCity.view()) {
+            int64_t next = child(node, static_cast<unsigned char>(c));
+            if (next < 0) {
+                return -1.0;
+            }
+            node = static_cast<size_t>(next);
+        }
+        if (!terminal[node]) {
+            return -1.0;
+        }
+        size_t t = terminal.rank1(node);
+        for (uint32_t p = payloadStart[t]; p < payloadStart[t + 1]; ++p) {
+            if (payloadCountries[p] == countryId) {
+                return payloadPopulations[p];
+            }
+        }
+        return -1.0;
+    }
+
+    size_t memoryUsage() const override {
+        return sizeof(LoudsNameTrie) + shape.memoryUsage() + terminal.memoryUsage() + labels.capacity() +
+               payloadStart.capacity() * sizeof(uint32_t) + payloadCountries.capacity() * sizeof(uint16_t) +
+               payloadPopulations.capacity() * sizeof(double) + countries.memoryUsage();
+    }
+
+    // Bytes of the shape, labels and terminal bits alone, excluding payloads.
+    size_t structureBytes() const {
+        return shape.memoryUsage() + terminal.memoryUsage() + labels.capacity();
+    }
+
+    size_t nodeCount() const override {
+        return nodes;
+    }
+};
+
+struct DawgHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t stateCount;
+    uint32_t edgeCount;
+    uint32_t wordCount;
+    uint32_t payloadCount;
+    uint32_t countryCount;
+};
+
+const char dawgMagic[8] = {'C', 'I', 'T', 'Y', 'D', 'A', 'W', 'G'};
+const uint32_t dawgVersion = 1;
+
+// Minimal acyclic automaton over the lowercased city names: the trie with every pair of
+// states that accept the same set of suffixes merged, so shared endings such as "-ville"
+// are stored once. Built offline with Daciuk's incremental algorithm over the sorted names.
+// Merged states cannot hold per-name payloads, so each edge records how many names sort
+// before the ones it leads to; summing those along a path gives the name's rank, which
+// indexes the payload arrays (a minimal perfect hash of the names). Inserts are staged and
+// the automaton is rebuilt on the next search.
+class DawgNameTrie : public CityIndex {
+private:
+    struct State {
+        uint32_t firstEdge;
+        uint16_t edgeCount;
+        uint8_t isFinal;
+        uint8_t unused;
+    };
+
+    vector<State> states;
+    vector<unsigned char> edgeLabels;
+    vector<uint32_t> edgeTargets;
+    vector<uint32_t> edgeRanks;
+    vector<uint32_t> payloadStart;
+    vector<uint16_t> payloadCountries;
+    vector<double> payloadPopulations;
+    CountryCodes countries;
+    vector<CityRow> pending;
+    size_t words = 0;
+
+    struct BuildState {
+        bool isFinal = false;
+        vector<pair<unsigned char, uint32_t>> edges;
+    };
+
+    // States are equivalent when they agree on finality and on every labelled target.
+    static string signature(const BuildState& state) {
+        string key(1, state.isFinal ? '1' : '0');
+        for (const auto& edge : state.edges) {
+            key.push_back(static_cast<char>(edge.first));
+            key.append(reinterpret_cast<const char*>(&edge.second), sizeof(edge.second));
+        }
+        return key;
+    }
+
+    void build() {
+        vector<CityRow> entries;
+        if (!states.empty()) {
+            vector<string> names;
+            string name;
+            collectNames(0, name, names);
+            for (uint32_t word = 0; word < names.size(); ++word) {
+                for (uint32_t p = payloadStart[word]; p < payloadStart[word + 1]; ++p) {
+                    entries.push_back({names[word], countries.code(payloadCountries[p]), payloadPopulations[p]});
+                }
+            }
+        }
+        for (CityRow& row : pending) {
+            entries.push_back(std::move(row));
+        }
+        pending.clear();
+        pending.shrink_to_fit();
+
+        // Later inserts overwrite earlier ones, so keep the last entry of each (city, country) pair.
+        stable_sort(entries.begin(), entries.end(), [](const CityRow& a, const CityRow& b) {
+            if (a.city != b.city) return a.city < b.city;
+            return a.country < b.country;
+        });
+        vector<CityRow> unique;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (i + 1 < entries.size() && entries[i + 1].city == entries[i].city && entries[i + 1].country == entries[i].country) {
+                continue;
+            }
+            unique.push_back(std::move(entries[i]));
+        }
+
+        vector<BuildState> built(1);
+        unordered_map<string, uint32_t> registry;
+        vector<uint32_t> path = {0};
+        string previous;
+        // Replaces the states on the unchecked part of the last path, deepest first, by an
+        // equivalent registered state where one exists.
+        auto minimize = [&](size_t depth) {
+            while (path.size() > depth + 1) {
+                uint32_t child = path.back();
+                path.pop_back();
+                string key = signature(built[child]);
+                auto it = registry.find(key);
+                if (it != registry.end()) {
+                    built[path.back()].edges.back().second = it->second;
+                    built[child] = BuildState();
+                } else {
+                    registry.emplace(std::move(key), child);
+                }
+            }
+        };
+
+        payloadStart.clear();
+        payloadCountries.clear();
+        payloadPopulations.clear();
+        countries = CountryCodes();
+        words = 0;
+        for (size_t i = 0; i < unique.size(); ++i) {
+            const string& name = unique[i].city;
+            if (i == 0 || name != previous) {
+                size_t common = 0;
+                while (common < name.size() && common < previous.size() && name[common] == previous[common]) {
+                    ++common;
+                }
+                minimize(common);
+                for (size_t d = common; d < name.size(); ++d) {
+                    uint32_t state = static_cast<uint32_t>(built.size());
+                    built.emplace_back();
+                    built[path.back()].edges.emplace_back(static_cast<unsigned char>(name[d]), state);
+                    path.push_back(state);
+                }
+                built[path.back()].isFinal = true;
+                payloadStart.push_back(static_cast<uint32_t>(payloadCountries.size()));
+                previous = name;
+                ++words;
+            }
+            payloadCountries.push_back(countries.intern(unique[i].country));
+            payloadPopulations.push_back(unique[i].population);
+        }
+        minimize(0);
+        payloadStart.push_back(static_cast<uint32_t>(payloadCountries.size()));
+
+        // Lay out the reachable states breadth-first and count the names below each one.
+        vector<uint32_t> order = {0};
+        vector<int64_t> slot(built.size(), -1);
+        slot[0] = 0;
+        for (size_t q = 0; q < order.size(); ++q) {
+            for (const auto& edge : built[order[q]].edges) {
+                if (slot[edge.second] < 0) {
+                    slot[edge.second] = static_cast<int64_t>(order.size());
+                    order.push_back(edge.second);
+                }
+            }
+        }
+        vector<uint32_t> wordCount(order.size(), 0);
+        states.assign(order.size(), {0, 0, 0, 0});
+        edgeLabels.clear();
+        edgeTargets.clear();
+        edgeRanks.clear();
+        for (size_t s = 0; s < order.size(); ++s) {
+            const BuildState& state = built[order[s]];
+            states[s] = {static_cast<uint32_t>(edgeLabels.size()), static_cast<uint16_t>(state.edges.size()), state.isFinal, 0};
+            for (const auto& edge : state.edges) {
+                edgeLabels.push_back(edge.first);
+                edgeTargets.push_back(static_cast<uint32_t>(slot[edge.second]));
+            }
+        }
+        // Breadth-first order is not topological in a DAG, so counts come from a post-order walk.
+        vector<bool> counted(states.size(), false);
+        vector<pair<uint32_t, uint32_t>> stack = {{0, 0}};
+        while (!stack.empty()) {
+            auto& [s, e] = stack.back();
+            if (e < states[s].edgeCount) {
+                uint32_t target = edgeTargets[states[s].firstEdge + e++];
+                if (!counted[target]) {
+                    stack.emplace_back(target, 0);
+                }
+                continue;
+            }
+            uint32_t count = states[s].isFinal;
+            for (uint32_t k = 0; k < states[s].edgeCount; ++k) {
+                count += wordCount[edgeTargets[states[s].firstEdge + k]];
+            }
+            wordCount[s] = count;
+            counted[s] = true;
+            stack.pop_back();
+        }
+        edgeRanks.resize(edgeTargets.size());
+        for (const State& state : states) {
+            uint32_t before = state.isFinal;
+            for (uint32_t k = state.firstEdge; k < state.firstEdge + state.edgeCount; ++k) {
+                edgeRanks[k] = before;
+                before += wordCount[edgeTargets[k]];
+            }
+        }
+        states.shrink_to_fit();
+        edgeLabels.shrink_to_fit();
+        edgeTargets.shrink_to_fit();
+        edgeRanks.shrink_to_fit();
+    }
+
+    // Appends the names accepted below state in rank order.
+    void collectNames(uint32_t state, string& name, vector<string>& out) const {
+        if (states[state].isFinal) {
+            out.push_back(name);
+        }
+        for (uint32_t k = states[state].firstEdge; k < states[state].firstEdge + states[state].edgeCount; ++k) {
+            name.push_back(static_cast<char>(edgeLabels[k]));
+            collectNames(edgeTargets[k], name, out);
+            name.pop_back();
+        }
+    }
+
+    // Rank of the name among all names, or -1 if the automaton does not accept it.
+    int64_t wordRank(string_view lowerCity) const {
+        uint32_t state = 0;
+        uint32_t rank = 0;
+        for (char c : lowerCity) {
+            const State& current = states[state];
+            const unsigned char* first = edgeLabels.data() + current.firstEdge;
+            const void* found = memchr(first, static_cast<unsigned char>(c), current.edgeCount);
+            if (!found) {
+                return -1;
+            }
+            size_t edge = static_cast<const unsigned char*>(found) - edgeLabels.data();
+            rank += edgeRanks[edge];
+            state = edgeTargets[edge];
+        }
+        return states[state].isFinal ? rank : -1;
+    }
+
+public:
+    void insert(string_view cityName, string_view countryCode, double population) override {
+        pending.push_back({toLower(cityName), toLower(countryCode), population});
+    }
+
+    void finalize() override {
+        if (!pending.empty()) {
+            build();
+        }
+    }
+
+    double search(string_view cityName, string_view countryCode) override {
+        finalize();
+        if (states.empty()) {
+            return -1.0;
+        }
+        int countryId = countries.find(FoldedText(countryCode).view());
+        FoldedText foldedCity(cityName);
+        int64_t word = countryId < 0 ? -1 : wordRank(foldedCity.view());
+        if (word < 0 || static_cast<size_t>(word) >= words) {
+            return -1.0;
+        }
+        for (uint32_t p = payloadStart[word]; p < payloadStart[word + 1]; ++p) {
+            if (payloadCountries[p] == countryId) {
+                return payloadPopulations[p];
+            }
+        }
+        return -1.0;
+    }
+
+    size_t memoryUsage() const override {
+        return sizeof(DawgNameTrie) + states.capacity() * sizeof(State) + edgeLabels.capacity() +
+               (edgeTargets.capacity() + edgeRanks.capacity() + payloadStart.capacity()) * sizeof(uint32_t) +
+               payloadCountries.capacity() * sizeof(uint16_t) + payloadPopulations.capacity() * sizeof(double) +
+               countries.memoryUsage() + pending.capacity() * sizeof(CityRow);
+    }
+
+    size_t nodeCount() const override {
+        return states.size();
+    }
+
+    size_t edgeCount() const {
+        return edgeLabels.size();
+    }
+
+    // Writes a header followed by the state, edge and payload arrays and the country codes,
+    // each code prefixed by its length.
+    bool save(const string& path) {
+        finalize();
+        ofstream out(path, ios::binary | ios::trunc);
+        if (!out.is_open()) {
+            cerr << "Error opening file " << path << endl;
+            return false;
+        }
+        DawgHeader header{};
+        memcpy(header.magic, dawgMagic, sizeof(header.magic));
+        header.version = dawgVersion;
+        header.stateCount = static_cast<uint32_t>(states.size());
+        header.edgeCount = static_cast<uint32_t>(edgeLabels.size());
+        header.wordCount = static_cast<uint32_t>(words);
+        header.payloadCount = static_cast<uint32_t>(payloadCountries.size());
+        header.countryCount = static_cast<uint32_t>(countries.size());
+        auto write = [&](const auto& items) {
+            out.write(reinterpret_cast<const char*>(items.data()), static_cast<streamsize>(items.size() * sizeof(items[0])));
+        };
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        write(states);
+        write(edgeLabels);
+        write(edgeTargets);
+        write(edgeRanks);
+        write(payloadStart);
+        write(payloadCountries);
+        write(payloadPopulations);
+        for (uint16_t id = 0; id < countries.size(); ++id) {
+            const string& code = countries.code(id);
+            uint32_t length = static_cast<uint32_t>(code.size());
+            out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+            out.write(code.data(), static_cast<streamsize>(code.size()));
+        }
+        return out.good();
+    }
+
+    bool load(const string& path) {
+        ifstream in(path, ios::binary);
+        if (!in.is_open()) {
+            cerr << "Error opening file " << path << endl;
+            return false;
+        }
+        DawgHeader header{};
+        in.read(reinterpret_cast<char*>(&header), sizeof(header));
+        if (!in || memcmp(header.magic, dawgMagic, sizeof(header.magic)) != 0 || header.version != dawgVersion ||
+            header.stateCount == 0 || header.countryCount > numeric_limits<uint16_t>::max() + 1u) {
+            cerr << "File " << path << " is not a valid city automaton" << endl;
+            return false;
+        }
+        auto read = [&](auto& items, size_t count) {
+            items.resize(count);
+            in.read(reinterpret_cast<char*>(items.data()), static_cast<streamsize>(count * sizeof(items[0])));
+        };
+        read(states, header.stateCount);
+        read(edgeLabels, header.edgeCount);
+        read(edgeTargets, header.edgeCount);
+        read(edgeRanks, header.edgeCount);
+        read(payloadStart, size_t(header.wordCount) + 1);
+        read(payloadCountries, header.payloadCount);
+        read(payloadPopulations, header.payloadCount);
+        countries = CountryCodes();
+        for (uint32_t id = 0; in && id < header.countryCount; ++id) {
+            uint32_t length = 0;
+            in.read(reinterpret_cast<char*>(&length), sizeof(length));
+            string code(in ? length : 0, '\0');
+            in.read(code.data(), static_cast<streamsize>(code.size()));
+            countries.intern(code);
+        }
+        words = header.wordCount;
+        pending.clear();
+        bool consistent = in && payloadStart.back() == header.payloadCount;
+        for (size_t s = 0; consistent && s < states.size(); ++s) {
+            consistent = uint64_t(states[s].firstEdge) + states[s].edgeCount <= header.edgeCount;
+        }
+        for (size_t e = 0; consistent && e < edgeTargets.size(); ++e) {
+            consistent = edgeTargets[e] < header.stateCount;
+        }
+        for (size_t w = 0; consistent && w < payloadStart.size(); ++w) {
+            consistent = payloadStart[w] <= header.payloadCount;
+        }
+        for (size_t p = 0; consistent && p < payloadCountries.size(); ++p) {
+            consistent = payloadCountries[p] < header.countryCount;
+        }
+        if (!consistent) {
+            cerr << "File " << path << " is not a valid city automaton" << endl;
+            states.clear();
+            return false;
+        }
+        return true;
+    }
+};
+
+// Hands each thread a reader slot for its lifetime and returns it when the thread exits,
+// so an EpochDomain needs no per-reader registration calls.
+size_t readerSlot(size_t maxReaders) {
+    static atomic<uint64_t> taken{0};
+    struct Registration {
+        size_t slot = 64;
+        Registration() {
+            uint64_t used = taken.load();
+            while (~used != 0) {
+                size_t free = countr_one(used);
+                if (taken.compare_exchange_weak(used, used | (1ULL << free))) {
+                    slot = free;
+                    return;
+                }
+            }
+        }
+        ~Registration() {
+            if (slot < 64) {
+                taken.fetch_and(~(1ULL << slot));
+            }
+        }
+    };
+    thread_local Registration registration;
+    if (registration.slot >= maxReaders) {
+        throw runtime_error("too many concurrent reader threads");
+    }
+    return registration.slot;
+}
+
+// Epoch-based reclamation for one writer and up to maxReaders reader threads. A reader
+// announces the global epoch in its slot before it touches shared data and withdraws after;
+// the writer stamps each retired object with the epoch at retirement and frees it once no
+// reader is still announcing that epoch or an older one. Guards do not nest.
+class EpochDomain {
+public:
+    static constexpr size_t maxReaders = 64;
+
+    class Guard {
+    private:
+        atomic<uint64_t>& announced;
+
+    public:
+        explicit Guard(EpochDomain& domain) : announced(domain.readers[readerSlot(maxReaders)].epoch) {
+            announced.store(domain.globalEpoch.load());
+        }
+        ~Guard() {
+            announced.store(idle, memory_order_release);
+        }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    ~EpochDomain() {
+        for (auto& entry : retired) {
+            entry.second();
+        }
+    }
+
+    // Writer only: the object must already be unreachable for new readers.
+    void retire(function<void()> release) {
+        retired.emplace_back(globalEpoch.fetch_add(1), std::move(release));
+    }
+
+    // Writer only: frees what no reader can still be looking at.
+    void reclaim() {
+        uint64_t oldest = idle;
+        for (const ReaderSlot& reader : readers) {
+            oldest = min(oldest, reader.epoch.load());
+        }
+        size_t kept = 0;
+        for (auto& entry : retired) {
+            if (entry.first < oldest) {
+                entry.second();
+            } else {
+                retired[kept++] = std::move(entry);
+            }
+        }
+        retired.resize(kept);
+    }
+
+    size_t pending() const {
+        return retired.size();
+    }
+
+private:
+    static constexpr uint64_t idle = numeric_limits<uint64_t>::max();
+
+    struct alignas(64) ReaderSlot {
+        atomic<uint64_t> epoch{idle};
+    };
+
+    ReaderSlot readers[maxReaders];
+    atomic<uint64_t> globalEpoch{1};
+    vector<pair<uint64_t, function<void()>>> retired;
+};
+
+// NameTrie that a single writer keeps updating while any number of threads search it
+// without locks. Readers see an immutable Version: a trie built at some point plus a delta
+// of populations changed or cities added since. The writer stages insert()s, and publish()
+// swaps in a new Version - sharing the delta's older layers, and adopting a trie rebuilt in
+// the background once the delta grows past a fraction of it - and retires the old one
+// through an EpochDomain.
+class LiveNameTrie : public CityIndex {
+private:
+    // Keys changed by one publish(), newest batch first, for invalidating reader caches.
+    struct ChangeBatch {
+        vector<string> keys;
+        uint64_t firstSequence;
+        size_t depth;
+        shared_ptr<const ChangeBatch> previous;
+    };
+
+    // A delta key looked up with its hash computed once, however many layers it probes.
+    struct HashedKey {
+        string_view text;
+        size_t hash;
+    };
+
+    struct DeltaHash {
+        using is_transparent = void;
+        size_t operator()(string_view text) const {
+            return hash<string_view>{}(text);
+        }
+        size_t operator()(const HashedKey& key) const {
+            return key.hash;
+        }
+    };
+
+    struct DeltaEqual {
+        using is_transparent = void;
+        bool operator()(string_view a, string_view b) const {
+            return a == b;
+        }
+        bool operator()(const HashedKey& a, string_view b) const {
+            return a.text == b;
+        }
+        bool operator()(string_view a, const HashedKey& b) const {
+            return a == b.text;
+        }
+    };
+
+    using DeltaMap = unordered_map<string, double, DeltaHash, DeltaEqual>;
+
+    // Populations published since a version's trie was built, newest layer first. Layers are
+    // immutable once published, so a publish shares the older ones and adds a layer for its
+    // own keys. It folds in the layer below only while that is no larger, so a delta of n
+    // keys has O(log n) layers and each key is copied O(log n) times.
+    struct DeltaLayer {
+        DeltaMap values;
+        shared_ptr<const DeltaLayer> older;
+        // Entries in this layer and every older one; a key changed again counts again.
+        size_t size;
+    };
+
+    struct Version {
+        shared_ptr<NameTrie> trie;
+        shared_ptr<const DeltaLayer> delta;
+        shared_ptr<const ChangeBatch> changes;
+        uint64_t sequence;
+    };
+
+    // Batches kept reachable for readers catching up; a reader further behind clears its cache.
+    static constexpr size_t maxChangeBatches = 64;
+
+    atomic<Version*> current{nullptr};
+    EpochDomain epochs;
+
+    // Writer-side state: the latest value of every key, a copy of which each rebuilt trie
+    // indexes, the row ids by key, and what the next publish() adds. Readers only touch the
+    // tries' nodes and the deltas, never the table.
+    CityTable rows;
+    CityKeySet rowIds{0, CityKeyHash{&rows}, CityKeyEqual{&rows}};
+    vector<uint32_t> pending;
+    // A trie being rebuilt in the background from a copy of rows, and the changes published
+    // since that copy was taken, which become its delta once it is ready.
+    future<shared_ptr<NameTrie>> rebuilt;
+    shared_ptr<const DeltaLayer> rebuiltDelta;
+
+    static shared_ptr<NameTrie> buildTrie(CityTable snapshot) {
+        auto trie = make_shared<NameTrie>(std::move(snapshot));
+        trie->indexRows();
+        return trie;
+    }
+
+    static shared_ptr<const DeltaLayer> pushLayer(shared_ptr<const DeltaLayer> older, DeltaMap values) {
+        auto layer = make_shared<DeltaLayer>();
+        layer->values = std::move(values);
+        while (older && older->values.size() <= layer->values.size()) {
+            for (const auto& [key, population] : older->values) {
+                layer->values.try_emplace(key, population);
+            }
+            older = older->older;
+        }
+        layer->size = layer->values.size() + (older ? older->size : 0);
+        layer->older = std::move(older);
+        return layer;
+    }
+
+    double lookup(const Version& version, string_view cityName, string_view countryCode) const {
+        if (version.delta) {
+            FoldedText key(countryCode, '|', cityName);
+            HashedKey hashed{key.view(), hash<string_view>{}(key.view())};
+            for (const DeltaLayer* layer = version.delta.get(); layer; layer = layer->older.get()) {
+                auto it = layer->values.find(hashed);
+                if (it != layer->values.end()) {
+                    return it->second;
+                }
+            }
+        }
+        return version.trie->search(cityName, countryCode);
+    }
+
+public:
+    LiveNameTrie() = default;
+
+    ~LiveNameTrie() override {
+        delete current.load();
+    }
+
+    LiveNameTrie(const LiveNameTrie&) = delete;
+    LiveNameTrie& operator=(const LiveNameTrie&) = delete;
+
+    // Writer only. Visible to readers after the next publish().
+    void insert(string_view cityName, string_view countryCode, double population) override {
+        auto it = rowIds.find(CityQuery{cityName, countryCode});
+        if (it == rowIds.end()) {
+            it = rowIds.insert(rows.add(cityName, countryCode, population)).first;
+        } else {
+            rows.setPopulation(*it, population);
+        }
+        pending.push_back(*it);
+    }
+
+    // Writer only. Publishing costs the pending keys plus amortised delta layer merges. Once
+    // the delta outgrows an eighth of the rows, a fresh trie is built on another thread from
+    // a copy of the rows, and the first publish after it is ready swaps it in.
+    void publish() {
+        Version* old = current.load();
+        if (old && pending.empty()) {
+            return;
+        }
+        Version* next = new Version();
+        if (!old) {
+            next->sequence = 0;
+        } else {
+            next->sequence = old->sequence + pending.size();
+            auto batch = make_shared<ChangeBatch>();
+            batch->firstSequence = old->sequence;
+            for (uint32_t id : pending) {
+                batch->keys.emplace_back(FoldedText(rows.country(id), '|', rows.city(id)).view());
+            }
+            if (old->changes && old->changes->depth < maxChangeBatches) {
+                batch->depth = old->changes->depth + 1;
+                batch->previous = old->changes;
+            } else {
+                batch->depth = 1;
+            }
+            next->changes = std::move(batch);
+        }
+
+        if (!old) {
+            next->trie = buildTrie(rows);
+        } else {
+            DeltaMap changed;
+            for (uint32_t id : pending) {
+                changed[string(FoldedText(rows.country(id), '|', rows.city(id)).view())] = rows.population(id);
+            }
+            if (rebuilt.valid() && rebuilt.wait_for(seconds(0)) == future_status::ready) {
+                next->trie = rebuilt.get();
+                next->delta = pushLayer(std::move(rebuiltDelta), std::move(changed));
+                rebuiltDelta = nullptr;
+            } else {
+                next->trie = old->trie;
+                if (rebuilt.valid()) {
+                    rebuiltDelta = pushLayer(std::move(rebuiltDelta), changed);
+                }
+                next->delta = pushLayer(old->delta, std::move(changed));
+                if (!rebuilt.valid() && next->delta->size > max<size_t>(1024, rows.size() / 8)) {
+                    rebuilt = async(launch::async, buildTrie, CityTable(rows));
+                }
+            }
+        }
+        pending.clear();
+
+        current.store(next);
+        if (old) {
+            epochs.retire([old]() { delete old; });
+        }
+        epochs.reclaim();
+    }
+
+    void finalize() override {
+        publish();
+    }
+
+    double search(string_view cityName, string_view countryCode) override {
+        EpochDomain::Guard guard(epochs);
+        const Version* version = current.load();
+        return version ? lookup(*version, cityName, countryCode) : -1.0;
+    }
+
+    void searchMany(span<const CityQuery> queries, span<double> results) override {
+        EpochDomain::Guard guard(epochs);
+        const Version* version = current.load();
+        if (!version) {
+            fill(results.begin(), results.end(), -1.0);
+        } else if (!version->delta) {
+            version->trie->searchMany(queries, results);
+        } else {
+            for (size_t i = 0; i < queries.size(); ++i) {
+                results[i] = lookup(*version, queries[i].city, queries[i].country);
+            }
+        }
+    }
+
+    // Reader side: erases from a thread's private cache every key published since that
+    // thread last synchronised at seenSequence, then advances seenSequence.
+    void invalidate(Cache& cache, uint64_t& seenSequence) {
+        EpochDomain::Guard guard(epochs);
+        const Version* version = current.load();
+        if (!version || version->sequence == seenSequence) {
+            return;
+        }
+        const ChangeBatch* batch = version->changes.get();
+        for (; batch && batch->firstSequence + batch->keys.size() > seenSequence; batch = batch->previous.get()) {
+            for (const string& key : batch->keys) {
+                cache.erase(key);
+            }
+            if (batch->firstSequence <= seenSequence) {
+                break;
+            }
+            if (!batch->previous) {
+                cache.clear();
+                break;
+            }
+        }
+        seenSequence = version->sequence;
+    }
+
+    // Writer only: retired versions still waiting for readers to leave.
+    size_t retiredVersions() const {
+        return epochs.pending();
+    }
+
+    size_t memoryUsage() const override {
+        const Version* version = current.load();
+        size_t bytes = sizeof(LiveNameTrie) + pending.capacity() * sizeof(uint32_t);
+        bytes += rowIds.bucket_count() * sizeof(void*) + rowIds.size() * (sizeof(void*) + sizeof(size_t) + sizeof(uint32_t));
+        // A published trie counts its own copy of the rows; the writer keeps another.
+        bytes += rows.memoryUsage();
+        if (version) {
+            bytes += version->trie->memoryUsage();
+            for (const DeltaLayer* layer = version->delta.get(); layer; layer = layer->older.get()) {
+                bytes += sizeof(DeltaLayer) + layer->values.bucket_count() * sizeof(void*) +
+                         layer->values.size() * (2 * sizeof(void*) + sizeof(pair<const string, double>));
+            }
+        }
+        return bytes;
+    }
+
+    size_t nodeCount() const override {
+        const Version* version = current.load();
+        return version ? version->trie->nodeCount() : 0;
+    }
+};
+
+// Rows ordered by descending population, with the populations also stored in Eytzinger
+// (BFS) order: a binary search then reads the array front to back, and the candidates
+// a few levels down share cache lines that can be prefetched. Range and top-N answers are
+// slices of the ordered ids, which index the rows the index was built from.
+class PopulationIndex {
+private:
+    vector<uint32_t> ids;
+    vector<double> tree;
+    vector<uint32_t> rank;
+
+    void layout(const vector<double>& sorted, size_t& next, size_t k) {
+        if (k >= tree.size()) {
+            return;
+        }
+        layout(sorted, next, 2 * k);
+        tree[k] = sorted[next];
+        rank[k] = static_cast<uint32_t>(next++);
+        layout(sorted, next, 2 * k + 1);
+    }
+
+    // Position in ids of the first row for which before(population) is false.
+    template<typename Before>
+    size_t partitionPoint(Before before) const {
+        size_t k = 1;
+        while (k < tree.size()) {
+            if (16 * k < tree.size()) {
+                prefetch(tree.data() + 16 * k);
+            }
+            k = 2 * k + before(tree[k]);
+        }
+        k >>= countr_one(k) + 1;
+        return k == 0 ? ids.size() : rank[k];
+    }
+
+public:
+    explicit PopulationIndex(const CityTable& rows) : ids(rows.size()), tree(rows.size() + 1), rank(rows.size() + 1) {
+        iota(ids.begin(), ids.end(), 0);
+        stable_sort(ids.begin(), ids.end(), [&](uint32_t a, uint32_t b) { return rows.population(a) > rows.population(b); });
+        vector<double> sorted(rows.size());
+        for (size_t i = 0; i < ids.size(); ++i) {
+            sorted[i] = rows.population(ids[i]);
+        }
+        size_t next = 0;
+        layout(sorted, next, 1);
+    }
+
+    // Rows with minPopulation <= population <= maxPopulation, most populous first.
+    span<const uint32_t> range(double minPopulation, double maxPopulation) const {
+        size_t first = partitionPoint([&](double population) { return population > maxPopulation; });
+        size_t last = partitionPoint([&](double population) { return population >= minPopulation; });
+        return first < last ? span<const uint32_t>(ids).subspan(first, last - first) : span<const uint32_t>();
+    }
+
+    span<const uint32_t> top(size_t n) const {
+        return span<const uint32_t>(ids).first(min(n, ids.size()));
+    }
+
+    size_t memoryUsage() const {
+        return sizeof(PopulationIndex) + ids.capacity() * sizeof(uint32_t) + tree.capacity() * sizeof(double) + rank.capacity() * sizeof(uint32_t);
+    }
+};
+
+// Parses a population field the way stod does: leading whitespace and a '+' are skipped
+// and anything after the number is ignored, so both loaders accept the same rows.
+errc parsePopulation(string_view text, double& population) {
+    size_t start = 0;
+    while (start < text.size() && isspace(static_cast<unsigned char>(text[start]))) {
+        ++start;
+    }
+    if (start < text.size() && text[start] == '+') {
+        ++start;
+    }
+    return from_chars(text.data() + start, text.data() + text.size(), population).ec;
+}
+
+// Positions of '"', ',' and '\n' in a 64-byte block, one bit per byte.
+struct CsvBlockMasks {
+    uint64_t quotes = 0;
+    uint64_t commas = 0;
+    uint64_t newlines = 0;
+};
+
+CsvBlockMasks csvBlockMasks(const char* in) {
+    CsvBlockMasks masks;
+#ifdef __AVX2__
+    for (int half = 0; half < 2; ++half) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + half * 32));
+        auto find = [block, half](char c) {
+            uint32_t bits = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(c))));
+            return static_cast<uint64_t>(bits) << (half * 32);
+        };
+        masks.quotes |= find('"');
+        masks.commas |= find(',');
+        masks.newlines |= find('\n');
+    }
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    for (int quarter = 0; quarter < 4; ++quarter) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + quarter * 16));
+        auto find = [block, quarter](char c) {
+            uint32_t bits = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c))));
+            return static_cast<uint64_t>(bits) << (quarter * 16);
+        };
+        masks.quotes |= find('"');
+        masks.commas |= find(',');
+        masks.newlines |= find('\n');
+    }
+#else
+    for (int i = 0; i < 64; ++i) {
+        masks.quotes |= static_cast<uint64_t>(in[i] == '"') << i;
+        masks.commas |= static_cast<uint64_t>(in[i] == ',') << i;
+        masks.newlines |= static_cast<uint64_t>(in[i] == '\n') << i;
+    }
+#endif
+    return masks;
+}
+
+// Marks the bytes inside quoted fields with a prefix XOR of the quote bits: every quote flips
+// the state, so an escaped "" flips it twice and leaves it unchanged. inside carries the state
+// out of the block as all ones or all zeros.
+uint64_t quotedBytes(uint64_t quotes, uint64_t& inside) {
+#ifdef __PCLMUL__
+    uint64_t region = static_cast<uint64_t>(_mm_cvtsi128_si64(_mm_clmulepi64_si128(
+        _mm_set_epi64x(0, static_cast<long long>(quotes)), _mm_set1_epi8(-1), 0)));
+#else
+    uint64_t region = quotes;
+    for (int shift = 1; shift < 64; shift *= 2) {
+        region ^= region << shift;
+    }
+#endif
+    region ^= inside;
+    inside = static_cast<uint64_t>(static_cast<int64_t>(region) >> 63);
+    return region;
+}
+
+// Runs onBlock(offset, masks) over text 64 bytes at a time; the last partial block is
+// zero-padded, so it carries no stray bits.
+template <typename BlockFn>
+void scanCsvBlocks(string_view text, BlockFn onBlock) {
+    char tail[64];
+    for (size_t pos = 0; pos < text.size(); pos += 64) {
+        const char* block = text.data() + pos;
+        if (text.size() - pos < 64) {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, block, text.size() - pos);
+            block = tail;
+        }
+        onBlock(pos, csvBlockMasks(block));
+    }
+}
+
+size_t countQuotes(string_view text) {
+    size_t quotes = 0;
+    scanCsvBlocks(text, [&](size_t, const CsvBlockMasks& masks) { quotes += popcount(masks.quotes); });
+    return quotes;
+}
+
+// Strips the quotes from an RFC 4180 quoted field and turns each "" back into ", copying
+// into scratch only when the field holds an escaped quote. Unquoted fields come back as is.
+string_view unquoteField(string_view field, string& scratch) {
+    if (field.empty() || field.front() != '"') {
+        return field;
+    }
+    field.remove_prefix(1);
+    if (!field.empty() && field.back() == '"') {
+        field.remove_suffix(1);
+    }
+    if (field.find('"') == string_view::npos) {
+        return field;
+    }
+    scratch.clear();
+    for (size_t i = 0; i < field.size(); ++i) {
+        scratch += field[i];
+        if (field[i] == '"' && i + 1 < field.size() && field[i + 1] == '"') {
+            ++i;
+        }
+    }
+    return scratch;
+}
+
+// Calls onRecord(line, fields) for each record of text, with fields holding its first three
+// fields still quoted; missing ones are empty and later ones are ignored. text must start at
+// a record boundary. Quoted fields may hold commas, newlines and "" escapes: the structural
+// commas and newlines are found a block at a time as the delimiter bits that fall outside
+// quotedBytes, so plain input never goes through a per-byte state machine. A CR before the
+// newline is dropped. Unless atEnd, a trailing record with no newline is left for the
+// caller, and the return value says how much was consumed.
+template <typename RecordFn>
+size_t scanCsvRecords(string_view text, RecordFn onRecord, bool atEnd = true) {
+    string_view fields[3];
+    size_t fieldCount = 0;
+    size_t fieldStart = 0;
+    size_t recordStart = 0;
+    auto endField = [&](size_t end) {
+        if (fieldCount < 3) {
+            fields[fieldCount] = string_view(text.data() + fieldStart, end - fieldStart);
+        }
+        ++fieldCount;
+        fieldStart = end + 1;
+    };
+    auto endRecord = [&](size_t end) {
+        size_t lineEnd = end > fieldStart && text[end - 1] == '\r' ? end - 1 : end;
+        endField(lineEnd);
+        fieldStart = end + 1;
+        onRecord(string_view(text.data() + recordStart, lineEnd - recordStart), static_cast<const string_view*>(fields));
+        fields[0] = fields[1] = fields[2] = string_view();
+        fieldCount = 0;
+        recordStart = fieldStart;
+    };
+
+    uint64_t inside = 0;
+    scanCsvBlocks(text, [&](size_t offset, const CsvBlockMasks& masks) {
+        uint64_t structural = masks.commas | masks.newlines;
+        if (masks.quotes | inside) {
+            structural &= ~quotedBytes(masks.quotes, inside);
+        }
+        while (structural) {
+            size_t bit = countr_zero(structural);
+            if (masks.newlines >> bit & 1) {
+                endRecord(offset + bit);
+            } else {
+                endField(offset + bit);
+            }
+            structural &= structural - 1;
+        }
+    });
+    if (atEnd && recordStart < text.size()) {
+        endRecord(text.size());
+    }
+    return atEnd ? text.size() : recordStart;
+}
+
+// Turns one record from scanCsvRecords into onRow(city, country, population), or reports it
+// through onError(line, reason) when the population does not parse. scratch holds three
+// strings for unquoting.
+template <typename RowFn, typename ErrorFn>
+void parseCityRecord(string_view line, const string_view* fields, string* scratch, RowFn& onRow, ErrorFn& onError) {
+    string_view cityName = unquoteField(fields[0], scratch[0]);
+    string_view countryCode = unquoteField(fields[1], scratch[1]);
+    double population = 0;
+    errc error = parsePopulation(unquoteField(fields[2], scratch[2]), population);
+    if (error != errc{}) {
+        onError(line, make_error_code(error).message());
+    } else {
+        onRow(cityName, countryCode, population);
+    }
+}
+
+// Calls onRow(city, country, population) for each well-formed record of text and
+// onError(line, reason) for the rest; see scanCsvRecords.
+template <typename RowFn, typename ErrorFn>
+size_t scanCityLines(string_view text, RowFn onRow, ErrorFn onError, bool atEnd = true) {
+    string scratch[3];
+    return scanCsvRecords(
+        text, [&](string_view line, const string_view* fields) { parseCityRecord(line, fields, scratch, onRow, onError); }, atEnd);
+}
+
+// Everything after the header line.
+string_view csvBody(const MappedFile& file) {
+    string_view text(file.data(), file.size());
+    size_t newline = text.find('\n');
+    return newline == string_view::npos ? string_view() : text.substr(newline + 1);
+}
+
+void reportParseError(string_view line, const string& reason) {
+    cerr << "Error parsing line: " << line << " - " << reason << endl;
+}
+
+// Reads CSV from fd through one buffer of chunkSize bytes that is reused for every read,
+// skips the header and calls onRecord(line, fields) as records arrive. A record cut off at
+// the end of a read is moved to the front of the buffer and completed by the next one; the
+// buffer only grows when a single record does not fit.
+template <typename RecordFn>
+bool readCsvRecords(int fd, RecordFn onRecord, size_t chunkSize = 64 * 1024) {
+    vector<char> buffer(chunkSize);
+    size_t filled = 0;
+    bool header = true;
+    bool atEnd = false;
+    while (!atEnd) {
+        if (filled == buffer.size()) {
+            buffer.resize(buffer.size() * 2);
+        }
+#ifdef _WIN32
+        int got = _read(fd, buffer.data() + filled, static_cast<unsigned>(buffer.size() - filled));
+#else
+        ssize_t got = ::read(fd, buffer.data() + filled, buffer.size() - filled);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+#endif
+        if (got < 0) {
+            cerr << "Error reading input: " << strerror(errno) << endl;
+            return false;
+        }
+        atEnd = got == 0;
+        filled += static_cast<size_t>(got);
+
+        string_view text(buffer.data(), filled);
+        size_t consumed = 0;
+        if (header) {
+            size_t newline = text.find('\n');
+            if (newline == string_view::npos && !atEnd) {
+                continue;
+            }
+            header = false;
+            consumed = newline == string_view::npos ? filled : newline + 1;
+        }
+        consumed += scanCsvRecords(text.substr(consumed), onRecord, atEnd);
+        memmove(buffer.data(), buffer.data() + consumed, filled - consumed);
+        filled -= consumed;
+    }
+    return true;
+}
+
+// Loads CSV records from a pipe, FIFO or file descriptor as they arrive through
+// readCsvRecords. Rows go to the index and are not kept, apart from a reservoir sample of
+// sampleSize rows, so memory beyond the index does not depend on the input size. The first
+// sampleSize rows go straight into the sample table. Later picks overwrite a fixed slot
+// per sample row, reusing its strings' buffers, and each slot reaches the table once the
+// input ends; CityTable::set would append every replacement's name to the table's pool.
+bool loadCitiesFromFd(int fd, CityIndex* index, CityTable& sample, size_t sampleSize, size_t& rowCount,
+                      size_t chunkSize = 64 * 1024) {
+    mt19937_64 rng(61);
+    const uint32_t firstId = static_cast<uint32_t>(sample.size());
+    vector<CityRow> replacements;
+    vector<bool> replaced;
+    rowCount = 0;
+    auto onRow = [&](string_view cityName, string_view countryCode, double population) {
+        if (index) {
+            index->insert(cityName, countryCode, population);
+        }
+        if (rowCount < sampleSize) {
+            sample.add(cityName, countryCode, population);
+        } else if (sampleSize > 0) {
+            size_t slot = rng() % (rowCount + 1);
+            if (slot < sampleSize) {
+                if (replacements.empty()) {
+                    replacements.resize(sampleSize);
+                    replaced.resize(sampleSize);
+                }
+                CityRow& row = replacements[slot];
+                row.city.assign(cityName);
+                row.country.assign(countryCode);
+                row.population = population;
+                replaced[slot] = true;
+            }
+        }
+        ++rowCount;
+    };
+    string scratch[3];
+    bool loaded = readCsvRecords(
+        fd, [&](string_view line, const string_view* fields) { parseCityRecord(line, fields, scratch, onRow, reportParseError); },
+        chunkSize);
+    for (size_t slot = 0; slot < replacements.size(); ++slot) {
+        if (replaced[slot]) {
+            const CityRow& row = replacements[slot];
+            sample.set(static_cast<uint32_t>(firstId + slot), row.city, row.country, row.population);
+        }
+    }
+    return loaded;
+}
+
+void closeDescriptor(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    ::close(fd);
+#endif
+}
+
+// loadCitiesFromFd over standard input ("-") or a named pipe or file.
+bool loadCitiesStream(const string& source, CityIndex* index, CityTable& sample, size_t sampleSize, size_t& rowCount) {
+    if (source == "-") {
+        return loadCitiesFromFd(0, index, sample, sampleSize, rowCount);
+    }
+#ifdef _WIN32
+    int fd = _open(source.c_str(), _O_RDONLY | _O_BINARY);
+#else
+    int fd = ::open(source.c_str(), O_RDONLY);
+#endif
+    if (fd < 0) {
+        cerr << "Error opening file " << source << endl;
+        return false;
+    }
+    bool loaded = loadCitiesFromFd(fd, index, sample, sampleSize, rowCount);
+    closeDescriptor(fd);
+    return loaded;
+}
+
+// Reads a whole CSV file with plain read() calls; the fallback for files that cannot be
+// mapped.
+bool loadCities(const string& csvFile, CityIndex* index, CityTable& rows) {
+    size_t rowCount = 0;
+    return loadCitiesStream(csvFile, index, rows, numeric_limits<size_t>::max(), rowCount);
+}
+
+// The getline loop the scanners replaced, with a stringstream and stod per line, kept only
+// as the baseline benchmarkLoad measures them against. It splits on every comma, so it
+// does not understand quoted fields.
+bool loadCitiesGetline(const string& csvFile, CityIndex* index, CityTable& rows) {
+    ifstream file(csvFile);
+    if (!file.is_open()) {
+        cerr << "Error opening file " << csvFile << endl;
+        return false;
+    }
+
+    string line;
+    getline(file, line);
+
+    while (getline(file, line)) {
+        stringstream ss(line);
+        string countryCode, cityName, populationStr;
+        getline(ss, cityName, ',');
+        getline(ss, countryCode, ',');
+        getline(ss, populationStr, ',');
+
+        try {
+            double population = stod(populationStr);
+            if (index) {
+                index->insert(cityName, countryCode, population);
+            }
+            rows.add(cityName, countryCode, population);
+        } catch (const exception &e) {
+            cerr << "Error parsing line: " << line << " - " << e.what() << endl;
+        }
+    }
+    file.close();
+    return true;
+}
+
+// Loads a file MappedFile::open turned down. A pipe or FIFO is read through the descriptor
+// open() left behind, keeping every row; anything else, such as an empty or missing file,
+// goes through loadCities.
+bool loadCitiesUnmapped(MappedFile& file, const string& csvFile, CityIndex* index, CityTable& rows) {
+    int fd = file.releaseStream();
+    if (fd < 0) {
+        return loadCities(csvFile, index, rows);
+    }
+    size_t rowCount = 0;
+    bool loaded = loadCitiesFromFd(fd, index, rows, numeric_limits<size_t>::max(), rowCount);
+    closeDescriptor(fd);
+    return loaded;
+}
+
+// Same result as loadCities, but scans the memory-mapped file with memchr and hands
+// string_views of the mapping straight to the index, with no per-line string or stream.
+// Files that cannot be mapped are left to loadCitiesUnmapped.
+bool loadCitiesMapped(const string& csvFile, CityIndex* index, CityTable& rows) {
+    MappedFile file;
+    if (!file.open(csvFile)) {
+        return loadCitiesUnmapped(file, csvFile, index, rows);
+    }
+    file.adviseSequential();
+
+    scanCityLines(
+        csvBody(file),
+        [&](string_view cityName, string_view countryCode, double population) {
+            if (index) {
+                index->insert(cityName, countryCode, population);
+            }
+            rows.add(cityName, countryCode, population);
+        },
+        reportParseError);
+    return true;
+}
+
+// Parses the mapped file on up to threadCount threads. The body is cut into equal byte
+// ranges, each moved forward to the next record start, and every worker builds its own rows
+// and error list. The chunks are then merged in file order, so rows, index insertion order
+// and error output all match loadCitiesMapped.
+bool loadCitiesParallel(const string& csvFile, CityIndex* index, CityTable& rows, unsigned threadCount) {
+    if (threadCount <= 1) {
+        return loadCitiesMapped(csvFile, index, rows);
+    }
+    MappedFile file;
+    if (!file.open(csvFile)) {
+        return loadCitiesUnmapped(file, csvFile, index, rows);
+    }
+
+    string_view body = csvBody(file);
+    threadCount = static_cast<unsigned>(max<size_t>(1, min<size_t>(threadCount, body.size() / 4096)));
+    auto runWorkers = [threadCount](const function<void(unsigned)>& work) {
+        vector<thread> workers;
+        for (unsigned t = 1; t < threadCount; ++t) {
+            workers.emplace_back(work, t);
+        }
+        work(0);
+        for (thread& worker : workers) {
+            worker.join();
+        }
+    };
+
+    // A newline inside a quoted field does not end a record, so each cut first needs the
+    // quote parity up to it: the workers count the quotes in their nominal ranges, and each
+    // cut then moves to the first newline past it that lies outside quotes.
+    auto nominal = [&](unsigned t) { return body.size() / threadCount * t; };
+    vector<size_t> quoteCounts(threadCount);
+    runWorkers([&](unsigned t) {
+        size_t end = t + 1 == threadCount ? body.size() : nominal(t + 1);
+        quoteCounts[t] = countQuotes(body.substr(nominal(t), end - nominal(t)));
+    });
+    vector<size_t> bounds(threadCount + 1, body.size());
+    bounds[0] = 0;
+    size_t quotesBefore = 0;
+    for (unsigned t = 1; t < threadCount; ++t) {
+        quotesBefore += quoteCounts[t - 1];
+        bool inside = quotesBefore % 2;
+        size_t cut = nominal(t);
+        if (inside || body[cut - 1] != '\n') {
+            for (; cut < body.size(); ++cut) {
+                if (body[cut] == '"') {
+                    inside = !inside;
+                } else if (body[cut] == '\n' && !inside) {
+                    ++cut;
+                    break;
+                }
+            }
+        }
+        bounds[t] = max(bounds[t - 1], cut);
+    }
+
+    struct Chunk {
+        CityTable rows;
+        vector<pair<string, string>> errors;
+    };
+    vector<Chunk> chunks(threadCount);
+    runWorkers([&](unsigned t) {
+        Chunk& chunk = chunks[t];
+        scanCityLines(
+            body.substr(bounds[t], bounds[t + 1] - bounds[t]),
+            [&](string_view cityName, string_view countryCode, double population) {
+                chunk.rows.add(cityName, countryCode, population);
+            },
+            [&](string_view line, const string& reason) { chunk.errors.emplace_back(line, reason); });
+    });
+
+    for (const Chunk& chunk : chunks) {
+        for (const auto& error : chunk.errors) {
+            reportParseError(error.first, error.second);
+        }
+        for (uint32_t id = 0; index && id < chunk.rows.size(); ++id) {
+            index->insert(chunk.rows.city(id), chunk.rows.country(id), chunk.rows.population(id));
+        }
+        rows.append(chunk.rows);
+    }
+    return true;
+}
+
+struct DeltaResult {
+    size_t upserts = 0;
+    size_t deletes = 0;
+    size_t missing = 0;
+};
+
+// Applies a change file in the CSV's city,country,population format to a loaded trie: a
+// row upserts its city, and a population of "-" deletes it. Every touched key is dropped
+// from the given caches so they cannot serve the old population.
+bool applyDelta(const string& deltaFile, NameTrie& trie, span<Cache* const> caches, DeltaResult& result) {
+#ifdef _WIN32
+    int fd = _open(deltaFile.c_str(), _O_RDONLY | _O_BINARY);
+#else
+    int fd = ::open(deltaFile.c_str(), O_RDONLY);
+#endif
+    if (fd < 0) {
+        cerr << "Error opening file " << deltaFile << endl;
+        return false;
+    }
+
+    string scratch[3];
+    bool read = readCsvRecords(fd, [&](string_view line, const string_view* fields) {
+        string_view cityName = unquoteField(fields[0], scratch[0]);
+        string_view countryCode = unquoteField(fields[1], scratch[1]);
+        string_view populationStr = unquoteField(fields[2], scratch[2]);
+        if (populationStr == "-") {
+            if (trie.erase(cityName, countryCode)) {
+                ++result.deletes;
+            } else {
+                ++result.missing;
+            }
+        } else {
+            double population = 0;
+            errc error = parsePopulation(populationStr, population);
+            if (error != errc{}) {
+                reportParseError(line, make_error_code(error).message());
+                return;
+            }
+            trie.insert(cityName, countryCode, population);
+            ++result.upserts;
+        }
+        FoldedText key(countryCode, '|', cityName);
+        for (Cache* cache : caches) {
+            cache->erase(key.view());
+        }
+    });
+    closeDescriptor(fd);
+    return read;
+}
+
+// A trie is built over table when one is given, so its city ids are the table's.
+CityIndex* createIndex(const string& type, CityTable* table = nullptr) {
+    if (type == "trie") {
+        return table ? new NameTrie(*table) : new NameTrie();
+    } else if (type == "flat") {
+        return new FlatNameTrie();
+    } else if (type == "radix") {
+        return new RadixNameTrie();
+    } else if (type == "mphf") {
+        return new PerfectHashIndex();
+    } else if (type == "live") {
+        return new LiveNameTrie();
+    } else if (type == "louds") {
+        return new LoudsNameTrie();
+    } else if (type == "dawg") {
+        return new DawgNameTrie();
+    }
+    return nullptr;
+}
+
+vector<pair<string, string>> makeMissQueries(const vector<CityRow>& rows, size_t count) {
+    vector<pair<string, string>> queries;
+    for (size_t i = 0; i < count && i < rows.size(); ++i) {
+        queries.emplace_back(rows[i].city + "q", rows[i].country);
+    }
+    return queries;
+}
+
+volatile double benchmarkSink;
+
+double averageSearchNanos(CityIndex& index, const vector<pair<string, string>>& queries) {
+    auto start = high_resolution_clock::now();
+    double checksum = 0;
+    for (const auto& q : queries) {
+        checksum += index.search(q.first, q.second);
+    }
+    auto end = high_resolution_clock::now();
+    benchmarkSink = checksum;
+    return duration<double, nano>(end - start).count() / queries.size();
+}
+
+int benchmarkIndexes(const vector<CityRow>& rows, const vector<string>& types) {
+    vector<pair<string, string>> hits;
+    for (const CityRow& row : rows) {
+        hits.emplace_back(row.city, row.country);
+    }
+    shuffle(hits.begin(), hits.end(), mt19937{42});
+    vector<pair<string, string>> misses = makeMissQueries(rows, rows.size());
+    shuffle(misses.begin(), misses.end(), mt19937{43});
+
+    NameTrie reference;
+    for (const CityRow& row : rows) {
+        reference.insert(row.city, row.country, row.population);
+    }
+
+    cout << "Index,BuildMs,Nodes,Bytes,BytesPerCity,HitNs,MissNs,Mismatches\n";
+    for (const string& type : types) {
+        CityIndex* index = createIndex(type);
+        auto start = high_resolution_clock::now();
+        for (const CityRow& row : rows) {
+            index->insert(row.city, row.country, row.population);
+        }
+        index->finalize();
+        auto end = high_resolution_clock::now();
+        double buildMs = duration<double, milli>(end - start).count();
+        size_t bytes = index->memoryUsage();
+        double hitNs = averageSearchNanos(*index, hits);
+        double missNs = averageSearchNanos(*index, misses);
+        size_t mismatches = 0;
+        for (const auto& q : hits) {
+            mismatches += index->search(q.first, q.second) != reference.search(q.first, q.second);
+        }
+        for (const auto& q : misses) {
+            mismatches += index->search(q.first, q.second) != reference.search(q.first, q.second);
+        }
+        cout << type << "," << fixed << setprecision(3) << buildMs << "," << index->nodeCount() << "," << bytes << ","
+             << static_cast<double>(bytes) / rows.size() << "," << hitNs << "," << missNs << "," << mismatches << "\n";
+        delete index;
+    }
+    return 0;
+}
+
+double percentile(vector<double> samples, double fraction) {
+    if (samples.empty()) {
+        return 0.0;
+    }
+    size_t rank = min(samples.size() - 1, static_cast<size_t>(fraction * samples.size()));
+    nth_element(samples.begin(), samples.begin() + rank, samples.end());
+    return samples[rank];
+}
+
+// The index comparison, plus how the LOUDS footprint splits between shape and payloads.
+int benchmarkLouds(const vector<CityRow>& rows) {
+    int status = benchmarkIndexes(rows, {"trie", "flat", "louds"});
+    LoudsNameTrie louds;
+    for (const CityRow& row : rows) {
+        louds.insert(row.city, row.country, row.population);
+    }
+    louds.finalize();
+    cout << "LoudsStructureBitsPerNode," << fixed << setprecision(2) << 8.0 * louds.structureBytes() / louds.nodeCount()
+         << ",PayloadBytes," << louds.memoryUsage() - louds.structureBytes() << "\n";
+    return status;
+}
+
+// The index comparison, the state and edge reduction over the trie, and a save/load round trip.
+int benchmarkDawg(const vector<CityRow>& rows) {
+    int status = benchmarkIndexes(rows, {"trie", "flat", "dawg"});
+    NameTrie trie;
+    DawgNameTrie dawg;
+    for (const CityRow& row : rows) {
+        trie.insert(row.city, row.country, row.population);
+        dawg.insert(row.city, row.country, row.population);
+    }
+    dawg.finalize();
+    TrieStats shape = trie.stats();
+    cout << "TrieNodes,DawgStates,StateReduction,TrieEdges,DawgEdges,EdgeReduction\n";
+    cout << shape.nodes << "," << dawg.nodeCount() << "," << fixed << setprecision(3)
+         << 1.0 - static_cast<double>(dawg.nodeCount()) / shape.nodes << "," << shape.nodes - 1 << "," << dawg.edgeCount() << ","
+         << 1.0 - static_cast<double>(dawg.edgeCount()) / (shape.nodes - 1) << "\n";
+
+    string path = "city_automaton.bin";
+    if (!dawg.save(path)) {
+        return 1;
+    }
+    DawgNameTrie loaded;
+    bool opened = loaded.load(path);
+    size_t mismatches = 0;
+    for (const CityRow& row : rows) {
+        mismatches += !opened || loaded.search(row.city, row.country) != trie.search(row.city, row.country);
+    }
+    ifstream saved(path, ios::binary | ios::ate);
+    cout << "FileBytes," << static_cast<long long>(saved.tellg()) << ",RoundTripMismatches," << mismatches << "\n";
+    saved.close();
+    remove(path.c_str());
+    return status;
+}
+
+// Applying change files of growing size to a loaded trie, against reloading the whole CSV.
+// Each result is checked against a trie built from scratch with the final rows, including
+// node counts, which only agree if deletes pruned every emptied branch.
+int benchmarkDelta(const vector<CityRow>& rows, const string& csvFile) {
+    auto start = high_resolution_clock::now();
+    {
+        NameTrie fresh;
+        CityTable reloaded;
+        loadCities(csvFile, &fresh, reloaded);
+    }
+    cout << "FullReloadMs," << fixed << setprecision(3) << duration<double, milli>(high_resolution_clock::now() - start).count() << "\n";
+    cout << "DeltaRows,ApplyMs,Upserts,Deletes,Mismatches,NodesMatch,StaleCacheHits\n";
+
+    const string path = "city_delta.csv";
+    mt19937 rng(54);
+    for (size_t size : {size_t(100), size_t(1000), size_t(10000)}) {
+        NameTrie trie;
+        map<string, CityRow> latest;
+        for (const CityRow& row : rows) {
+            trie.insert(row.city, row.country, row.population);
+            latest[toLower(row.country) + "|" + toLower(row.city)] = row;
+        }
+
+        // Roughly 45% population changes, 10% new cities and 45% deletes.
+        ofstream out(path);
+        out << "city,country,population\n";
+        vector<CityRow> changes;
+        for (size_t i = 0; i < size; ++i) {
+            CityRow row = rows[rng() % rows.size()];
+            unsigned kind = rng() % 20;
+            string population = to_string(rng() % 10000000);
+            if (kind < 2) {
+                row.city += " nova " + to_string(i);
+            }
+            string key = toLower(row.country) + "|" + toLower(row.city);
+            if (kind >= 11) {
+                population = "-";
+                latest.erase(key);
+            } else {
+                row.population = stod(population);
+                latest[key] = row;
+            }
+            out << row.city << "," << row.country << "," << population << "\n";
+            changes.push_back(row);
+        }
+        out.close();
+
+        LFUCache cache(10);
+        for (size_t i = 0; i < 10; ++i) {
+            cache.put(FoldedText(changes[i].country, '|', changes[i].city).view(), static_cast<uint32_t>(i), -2.0);
+        }
+        Cache* caches[] = {&cache};
+        DeltaResult applied;
+        start = high_resolution_clock::now();
+        applyDelta(path, trie, caches, applied);
+        double applyMs = duration<double, milli>(high_resolution_clock::now() - start).count();
+
+        NameTrie reference;
+        for (const auto& entry : latest) {
+            reference.insert(entry.second.city, entry.second.country, entry.second.population);
+        }
+        size_t mismatches = 0;
+        auto compare = [&](const vector<CityRow>& list) {
+            for (const CityRow& row : list) {
+                mismatches += trie.search(row.city, row.country) != reference.search(row.city, row.country);
+            }
+        };
+        compare(rows);
+        compare(changes);
+        for (const char* prefix : {"", "a", "sa", "ber"}) {
+            vector<CityRow> expected = reference.complete(prefix, NameTrie::maxCompletions);
+            vector<CityRow> actual = trie.complete(prefix, NameTrie::maxCompletions);
+            bool same = expected.size() == actual.size();
+            for (size_t i = 0; same && i < actual.size(); ++i) {
+                same = expected[i].population == actual[i].population;
+            }
+            mismatches += !same;
+        }
+        size_t stale = 0;
+        for (size_t i = 0; i < 10; ++i) {
+            double population;
+            stale += cache.get(FoldedText(changes[i].country, '|', changes[i].city).view(), population);
+        }
+        cout << size << "," << applyMs << "," << applied.upserts << "," << applied.deletes << "," << mismatches << ","
+             << (trie.nodeCount() == reference.nodeCount() ? "yes" : "no") << "," << stale << "\n";
+    }
+    remove(path.c_str());
+    return 0;
+}
+
+int benchmarkCompletion(const vector<CityRow>& rows) {
+    NameTrie trie;
+    unordered_map<string, CityRow> latest;
+    for (const CityRow& row : rows) {
+        trie.insert(row.city, row.country, row.population);
+        latest[toLower(row.country) + "|" + toLower(row.city)] = row;
+    }
+
+    vector<size_t> order(rows.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    shuffle(order.begin(), order.end(), mt19937{44});
+
+    cout << "PrefixLength,Queries,AvgNs,P99Ns,CountryAvgNs,CountryP99Ns,Mismatches\n";
+    for (size_t length = 1; length <= 3; ++length) {
+        vector<pair<string, string>> queries;
+        for (size_t i : order) {
+            if (rows[i].city.size() >= length && queries.size() < 20000) {
+                queries.emplace_back(rows[i].city.substr(0, length), rows[i].country);
+            }
+        }
+
+        vector<double> plain, filtered;
+        size_t results = 0;
+        for (const auto& q : queries) {
+            auto start = high_resolution_clock::now();
+            results += trie.complete(q.first, NameTrie::maxCompletions).size();
+            auto mid = high_resolution_clock::now();
+            results += trie.complete(q.first, NameTrie::maxCompletions, q.second).size();
+            auto end = high_resolution_clock::now();
+            plain.push_back(duration<double, nano>(mid - start).count());
+            filtered.push_back(duration<double, nano>(end - mid).count());
+        }
+        benchmarkSink = static_cast<double>(results);
+
+        size_t mismatches = 0;
+        for (size_t i = 0; i < queries.size() && i < 100; ++i) {
+            string lowerPrefix = toLower(queries[i].first);
+            string lowerCountry = toLower(queries[i].second);
+            vector<double> expected, expectedInCountry;
+            for (const auto& entry : latest) {
+                if (toLower(entry.second.city).compare(0, lowerPrefix.size(), lowerPrefix) == 0) {
+                    expected.push_back(entry.second.population);
+                    if (toLower(entry.second.country) == lowerCountry) {
+                        expectedInCountry.push_back(entry.second.population);
+                    }
+                }
+            }
+            for (vector<double>* list : {&expected, &expectedInCountry}) {
+                sort(list->rbegin(), list->rend());
+                list->resize(min(list->size(), NameTrie::maxCompletions));
+            }
+            vector<CityRow> actual = trie.complete(queries[i].first, NameTrie::maxCompletions);
+            vector<CityRow> actualInCountry = trie.complete(queries[i].first, NameTrie::maxCompletions, queries[i].second);
+            bool same = actual.size() == expected.size() && actualInCountry.size() == expectedInCountry.size();
+            for (size_t j = 0; same && j < actual.size(); ++j) {
+                same = actual[j].population == expected[j];
+            }
+            for (size_t j = 0; same && j < actualInCountry.size(); ++j) {
+                same = actualInCountry[j].population == expectedInCountry[j];
+            }
+            mismatches += !same;
+        }
+
+        cout << length << "," << queries.size() << "," << fixed << setprecision(1)
+             << accumulate(plain.begin(), plain.end(), 0.0) / plain.size() << "," << percentile(plain, 0.99) << ","
+             << accumulate(filtered.begin(), filtered.end(), 0.0) / filtered.size() << "," << percentile(filtered, 0.99) << ","
+             << mismatches << "\n";
+    }
+    return 0;
+}
+
+string misspell(const string& name, int edits, mt19937& rng) {
+    string result = name;
+    for (int e = 0; e < edits; ++e) {
+        size_t pos = rng() % (result.size() + 1);
+        char letter = static_cast<char>('a' + rng() % 26);
+        int kind = rng() % 3;
+        if (kind == 0 && pos < result.size()) {
+            result[pos] = letter;
+        } else if (kind == 1 && pos < result.size() && result.size() > 1) {
+            result.erase(pos, 1);
+        } else {
+            result.insert(result.begin() + pos, letter);
+        }
+    }
+    return result;
+}
+
+// Per-country listings from NameTrie::citiesInCountry against filtering and sorting the
+// deduplicated rows, which is what answering them took before the country index.
+int benchmarkCountryIndex(const vector<CityRow>& rows) {
+    NameTrie trie;
+    unordered_map<string, CityRow> latest;
+    for (const CityRow& row : rows) {
+        trie.insert(row.city, row.country, row.population);
+        latest[toLower(row.country) + "|" + toLower(row.city)] = row;
+    }
+    auto start = high_resolution_clock::now();
+    trie.finalize();
+    double buildMs = duration<double, milli>(high_resolution_clock::now() - start).count();
+    vector<CityRow> unique;
+    vector<string> countries;
+    for (const auto& entry : latest) {
+        unique.push_back(entry.second);
+        countries.push_back(toLower(entry.second.country));
+    }
+    sort(countries.begin(), countries.end());
+    countries.erase(std::unique(countries.begin(), countries.end()), countries.end());
+
+    cout << "IndexBuildMs," << fixed << setprecision(3) << buildMs << ",Countries," << countries.size() << "\n";
+    cout << "Limit,IndexNs,ScanNs,Mismatches\n";
+    for (size_t limit : {size_t(10), numeric_limits<size_t>::max()}) {
+        double indexNs = 0, scanNs = 0;
+        size_t mismatches = 0;
+        for (const string& country : countries) {
+            start = high_resolution_clock::now();
+            span<const uint32_t> ids = trie.citiesInCountry(country, limit);
+            double total = 0;
+            for (uint32_t id : ids) {
+                total += trie.cityRow(id).population;
+            }
+            auto mid = high_resolution_clock::now();
+            vector<const CityRow*> matches;
+            for (const CityRow& row : unique) {
+                if (toLower(row.country) == country) {
+                    matches.push_back(&row);
+                }
+            }
+            size_t n = min(limit, matches.size());
+            partial_sort(matches.begin(), matches.begin() + n, matches.end(),
+                         [](const CityRow* a, const CityRow* b) { return a->population > b->population; });
+            auto end = high_resolution_clock::now();
+            benchmarkSink = total;
+            indexNs += duration<double, nano>(mid - start).count();
+            scanNs += duration<double, nano>(end - mid).count();
+            bool same = ids.size() == n;
+            for (size_t i = 0; same && i < n; ++i) {
+                same = trie.cityRow(ids[i]).population == matches[i]->population;
+            }
+            mismatches += !same;
+        }
+        cout << (limit == 10 ? "10" : "all") << "," << indexNs / countries.size() << "," << scanNs / countries.size() << "," << mismatches << "\n";
+    }
+    return 0;
+}
+
+// Population range and top-N queries through PopulationIndex against scanning the rows.
+int benchmarkPopulationIndex(const vector<CityRow>& rows) {
+    CityTable table;
+    for (const CityRow& row : rows) {
+        table.add(row.city, row.country, row.population);
+    }
+    auto start = high_resolution_clock::now();
+    PopulationIndex index(table);
+    double buildMs = duration<double, milli>(high_resolution_clock::now() - start).count();
+    cout << "BuildMs," << fixed << setprecision(3) << buildMs << ",Bytes," << index.memoryUsage() << "\n";
+
+    vector<double> populations;
+    for (const CityRow& row : rows) {
+        populations.push_back(row.population);
+    }
+    sort(populations.begin(), populations.end());
+    mt19937 rng(53);
+    cout << "Query,Queries,AvgResults,IndexNs,ScanNs,Mismatches\n";
+    // Ranges are drawn by rank, so each width selects about that many rows.
+    for (size_t width : {size_t(1), size_t(100), size_t(10000)}) {
+        size_t queries = 200, results = 0, mismatches = 0;
+        double indexNs = 0, scanNs = 0;
+        for (size_t q = 0; q < queries; ++q) {
+            size_t low = rng() % populations.size();
+            double minPopulation = populations[low];
+            double maxPopulation = populations[min(populations.size() - 1, low + width - 1)];
+            start = high_resolution_clock::now();
+            span<const uint32_t> found = index.range(minPopulation, maxPopulation);
+            double total = 0;
+            for (uint32_t id : found) {
+                total += rows[id].population;
+            }
+            auto mid = high_resolution_clock::now();
+            vector<uint32_t> scanned;
+            for (uint32_t i = 0; i < rows.size(); ++i) {
+                if (rows[i].population >= minPopulation && rows[i].population <= maxPopulation) {
+                    scanned.push_back(i);
+                }
+            }
+            auto end = high_resolution_clock::now();
+            benchmarkSink = total;
+            indexNs += duration<double, nano>(mid - start).count();
+            scanNs += duration<double, nano>(end - mid).count();
+            results += found.size();
+            vector<uint32_t> sortedFound(found.begin(), found.end());
+            sort(sortedFound.begin(), sortedFound.end());
+            mismatches += sortedFound != scanned;
+        }
+        cout << "Range" << width << "," << queries << "," << results / queries << "," << indexNs / queries << "," << scanNs / queries << "," << mismatches << "\n";
+    }
+    for (size_t n : {size_t(10), size_t(1000)}) {
+        size_t queries = 200, mismatches = 0;
+        double indexNs = 0, scanNs = 0;
+        for (size_t q = 0; q < queries; ++q) {
+            start = high_resolution_clock::now();
+            span<const uint32_t> found = index.top(n);
+            double total = 0;
+            for (uint32_t id : found) {
+                total += rows[id].population;
+            }
+            auto mid = high_resolution_clock::now();
+            vector<uint32_t> scanned(rows.size());
+            iota(scanned.begin(), scanned.end(), 0);
+            size_t k = min(n, scanned.size());
+            partial_sort(scanned.begin(), scanned.begin() + k, scanned.end(),
+                         [&](uint32_t a, uint32_t b) { return rows[a].population > rows[b].population; });
+            auto end = high_resolution_clock::now();
+            benchmarkSink = total;
+            indexNs += duration<double, nano>(mid - start).count();
+            scanNs += duration<double, nano>(end - mid).count();
+            bool same = found.size() == k;
+            for (size_t i = 0; same && i < k; ++i) {
+                same = rows[found[i]].population == rows[scanned[i]].population;
+            }
+            mismatches += !same;
+        }
+        cout << "Top" << n << "," << queries << "," << n << "," << indexNs / queries << "," << scanNs / queries << "," << mismatches << "\n";
+    }
+    return 0;
+}
+
+int benchmarkFuzzy(const vector<CityRow>& rows) {
+    NameTrie trie;
+    for (const CityRow& row : rows) {
+        trie.insert(row.city, row.country, row.population);
+    }
+
+    mt19937 rng(45);
+    cout << "MaxDistance,Country,Queries,AvgUs,P50Us,P99Us,Recall\n";
+    for (int maxDistance = 1; maxDistance <= 2; ++maxDistance) {
+        for (bool withCountry : {true, false}) {
+            vector<double> samples;
+            size_t found = 0;
+            size_t queries = min<size_t>(rows.size(), 5000);
+            for (size_t i = 0; i < queries; ++i) {
+                const CityRow& row = rows[rng() % rows.size()];
+                string typo = misspell(toLower(row.city), 1 + rng() % maxDistance, rng);
+                auto start = high_resolution_clock::now();
+                vector<FuzzyMatch> matches = trie.fuzzySearch(typo, withCountry ? row.country : "", maxDistance);
+                auto end = high_resolution_clock::now();
+                samples.push_back(duration<double, micro>(end - start).count());
+                for (const FuzzyMatch& match : matches) {
+                    if (toLower(match.city.city) == toLower(row.city) && toLower(match.city.country) == toLower(row.country)) {
+                        ++found;
+                        break;
+                    }
+                }
+            }
+            cout << maxDistance << "," << (withCountry ? "yes" : "no") << "," << queries << "," << fixed << setprecision(1)
+                 << accumulate(samples.begin(), samples.end(), 0.0) / samples.size() << ","
+                 << percentile(samples, 0.5) << "," << percentile(samples, 0.99) << ","
+                 << setprecision(3) << static_cast<double>(found) / queries << "\n";
+        }
+    }
+    return 0;
+}
+
+int benchmarkSnapshot(const vector<CityRow>& rows, const string& csvFile) {
+    string snapshotFile = csvFile + ".snapshot";
+
+    auto start = high_resolution_clock::now();
+    NameTrie trie;
+    CityTable parsed;
+    loadCities(csvFile, &trie, parsed);
+    trie.search(rows[0].city, rows[0].country);
+    double csvMs = duration<double, milli>(high_resolution_clock::now() - start).count();
+
+    start = high_resolution_clock::now();
+    FlatNameTrie flat;
+    for (const CityRow& row : rows) {
+        flat.insert(row.city, row.country, row.population);
+    }
+    if (!flat.saveSnapshot(snapshotFile)) {
+        return 1;
+    }
+    double writeMs = duration<double, milli>(high_resolution_clock::now() - start).count();
+
+    vector<pair<string, string>> hits;
+    for (const CityRow& row : rows) {
+        hits.emplace_back(row.city, row.country);
+    }
+    shuffle(hits.begin(), hits.end(), mt19937{46});
+
+    // The mapping has to be closed before the snapshot can be removed.
+    double firstQueryMs, hitNs;
+    size_t mismatches = 0;
+    {
+        start = high_resolution_clock::now();
+        MappedNameTrie mapped;
+        if (!mapped.open(snapshotFile)) {
+            remove(snapshotFile.c_str());
+            return 1;
+        }
+        mapped.search(rows[0].city, rows[0].country);
+        firstQueryMs = duration<double, milli>(high_resolution_clock::now() - start).count();
+
+        for (const auto& q : hits) {
+            mismatches += mapped.search(q.first, q.second) != trie.search(q.first, q.second);
+        }
+        hitNs = averageSearchNanos(mapped, hits);
+    }
+    streamoff snapshotBytes = ifstream(snapshotFile, ios::binary | ios::ate).tellg();
+    remove(snapshotFile.c_str());
+
+    cout << "CsvLoadToFirstQueryMs,SnapshotWriteMs,SnapshotBytes,MapToFirstQueryMs,MappedHitNs,Mismatches\n";
+    cout << fixed << setprecision(3) << csvMs << "," << writeMs << "," << snapshotBytes << "," << firstQueryMs << ","
+         << hitNs << "," << mismatches << "\n";
+    return 0;
+}
+
+size_t currentRssBytes() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.WorkingSetSize;
+    }
+    return 0;
+#else
+    ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+// High-water mark of the resident set since the last resetPeakRss().
+size_t peakRssBytes() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.rfind("VmHWM:", 0) == 0) {
+            return strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+        }
+    }
+    return 0;
+#endif
+}
+
+// Linux lets a process reset its VmHWM; Windows has no equivalent, so there the peak
+// covers the whole run.
+void resetPeakRss() {
+#ifndef _WIN32
+    ofstream("/proc/self/clear_refs") << "5";
+#endif
+}
+
+// Writes csvFile + ".x<copies>", repeating every data row copies times under the original
+// header, and returns its path.
+string writeInflatedCsv(const string& csvFile, int copies) {
+    const string inflated = csvFile + ".x" + to_string(copies);
+    ifstream in(csvFile, ios::binary);
+    string header, body;
+    getline(in, header);
+    body.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    if (!body.empty() && body.back() != '\n') {
+        body += '\n';
+    }
+    ofstream out(inflated, ios::binary);
+    out << header << "\n";
+    for (int i = 0; i < copies; ++i) {
+        out << body;
+    }
+    return inflated;
+}
+
+int benchmarkLoad(const string& csvFile) {
+    const string inflated = writeInflatedCsv(csvFile, 10);
+
+    // Mismatches are counted against the getline baseline.
+    using Loader = bool (*)(const string&, CityIndex*, CityTable&);
+    const pair<const char*, Loader> loaders[] = {{"getline", loadCitiesGetline}, {"read", loadCities}, {"mmap", loadCitiesMapped}};
+    const size_t loaderCount = size(loaders);
+    cout << "Input,Target,Loader,Rows,LoadMs,RowsPerSec,PeakRssDeltaBytes,Mismatches\n";
+    for (const string& input : {csvFile, inflated}) {
+        for (bool intoTrie : {false, true}) {
+            // Every run's rows and trie stay alive until all loaders are done, so a later
+            // loader cannot look lighter by reusing heap an earlier one freed.
+            CityTable loaded[loaderCount];
+            unique_ptr<NameTrie> tries[loaderCount];
+            for (size_t l = 0; l < loaderCount; ++l) {
+                if (intoTrie) {
+                    tries[l] = make_unique<NameTrie>();
+                }
+                size_t rssBefore = currentRssBytes();
+                resetPeakRss();
+                auto start = high_resolution_clock::now();
+                loaders[l].second(input, tries[l].get(), loaded[l]);
+                double loadMs = duration<double, milli>(high_resolution_clock::now() - start).count();
+                long long peakDelta = static_cast<long long>(peakRssBytes()) - static_cast<long long>(rssBefore);
+
+                size_t mismatches = loaded[l].size() != loaded[0].size();
+                for (uint32_t i = 0; !mismatches && i < loaded[l].size(); ++i) {
+                    mismatches += loaded[l].row(i) != loaded[0].row(i);
+                }
+                if (intoTrie) {
+                    mismatches += tries[l]->nodeCount() != tries[0]->nodeCount();
+                }
+                cout << (input == csvFile ? "x1" : "x10") << "," << (intoTrie ? "trie" : "rows") << "," << loaders[l].first << ","
+                     << loaded[l].size() << "," << fixed << setprecision(3) << loadMs << "," << setprecision(0)
+                     << loaded[l].size() / (loadMs / 1000) << "," << peakDelta << "," << mismatches << "\n";
+            }
+        }
+    }
+    remove(inflated.c_str());
+    return 0;
+}
+
+// Quotes a field the RFC 4180 way when it holds a comma, quote or newline.
+string csvField(const string& text) {
+    if (text.find_first_of(",\"\n") == string::npos) {
+        return text;
+    }
+    string quoted = "\"";
+    for (char c : text) {
+        quoted += c;
+        if (c == '"') {
+            quoted += '"';
+        }
+    }
+    return quoted + "\"";
+}
+
+int benchmarkQuotedLoad(const vector<CityRow>& rows, const string& csvFile) {
+    // Every other name gains a comma, an escaped quote or an embedded newline.
+    vector<CityRow> expected;
+    const string quotedFile = csvFile + ".quoted";
+    {
+        ofstream out(quotedFile, ios::binary);
+        out << setprecision(numeric_limits<double>::max_digits10) << "city,country,population\n";
+        for (int copy = 0; copy < 10; ++copy) {
+            for (size_t i = 0; i < rows.size(); ++i) {
+                CityRow row = rows[i];
+                switch (i % 6) {
+                    case 0: row.city += ", D.C."; break;
+                    case 2: row.city = "\"" + row.city + "\" town"; break;
+                    case 4: row.city += "\nupper"; break;
+                }
+                out << csvField(row.city) << "," << csvField(row.country) << "," << row.population << "\n";
+                expected.push_back(row);
+            }
+        }
+    }
+    const string plainFile = writeInflatedCsv(csvFile, 10);
+
+    cout << "Input,Threads,Rows,LoadMs,MBPerSec,Mismatches\n";
+    for (const string& input : {plainFile, quotedFile}) {
+        ifstream sized(input, ios::binary | ios::ate);
+        double megabytes = static_cast<double>(sized.tellg()) / 1e6;
+        for (unsigned threads : {1u, 4u}) {
+            CityTable loaded;
+            auto start = high_resolution_clock::now();
+            loadCitiesParallel(input, nullptr, loaded, threads);
+            double loadMs = duration<double, milli>(high_resolution_clock::now() - start).count();
+            size_t mismatches = 0;
+            if (input == quotedFile) {
+                mismatches = loaded.size() != expected.size();
+                for (uint32_t i = 0; !mismatches && i < loaded.size(); ++i) {
+                    mismatches += loaded.row(i) != expected[i];
+                }
+            }
+            cout << (input == plainFile ? "plain" : "quoted") << "," << threads << "," << loaded.size() << "," << fixed
+                 << setprecision(3) << loadMs << "," << setprecision(1) << megabytes / (loadMs / 1000) << "," << mismatches << "\n";
+        }
+    }
+    remove(plainFile.c_str());
+    remove(quotedFile.c_str());
+    return 0;
+}
+
+int benchmarkStreamLoad(const vector<CityRow>& rows, const string& csvFile) {
+    // Feeds path through a pipe from a writer thread, like a producer upstream would.
+    auto streamThroughPipe = [](const string& path, NameTrie& trie, CityTable& sample, size_t chunkSize) {
+        int fds[2];
+#ifdef _WIN32
+        if (_pipe(fds, 64 * 1024, _O_BINARY) != 0) {
+            return size_t(0);
+        }
+#else
+        if (pipe(fds) != 0) {
+            return size_t(0);
+        }
+#endif
+        thread writer([&path, out = fds[1]]() {
+            ifstream in(path, ios::binary);
+            vector<char> block(64 * 1024);
+            while (in.read(block.data(), block.size()) || in.gcount() > 0) {
+                const char* data = block.data();
+                size_t left = static_cast<size_t>(in.gcount());
+                while (left > 0) {
+#ifdef _WIN32
+                    int wrote = _write(out, data, static_cast<unsigned>(left));
+#else
+                    ssize_t wrote = ::write(out, data, left);
+#endif
+                    if (wrote <= 0) {
+                        break;
+                    }
+                    data += wrote;
+                    left -= static_cast<size_t>(wrote);
+                }
+            }
+#ifdef _WIN32
+            _close(out);
+#else
+            ::close(out);
+#endif
+        });
+        size_t rowCount = 0;
+        loadCitiesFromFd(fds[0], &trie, sample, 250, rowCount, chunkSize);
+        writer.join();
+#ifdef _WIN32
+        _close(fds[0]);
+#else
+        ::close(fds[0]);
+#endif
+        return rowCount;
+    };
+
+    // Inflated inputs repeat the same rows, so the finished trie is the same size for each
+    // and any growth in peak RSS is loader overhead.
+    cout << "Input,Loader,ChunkBytes,Rows,LoadMs,PeakRssDeltaBytes,IndexBytes,Mismatches\n";
+    for (int copies : {1, 4, 16}) {
+        const string input = copies == 1 ? csvFile : writeInflatedCsv(csvFile, copies);
+        for (size_t chunkSize : {size_t(0), size_t(64 * 1024), size_t(97)}) {
+            if (chunkSize == 97 && copies != 1) {
+                continue;
+            }
+#ifdef __GLIBC__
+            malloc_trim(0);
+#endif
+            NameTrie trie;
+            CityTable kept;
+            size_t rssBefore = currentRssBytes();
+            resetPeakRss();
+            auto start = high_resolution_clock::now();
+            size_t rowCount = 0;
+            if (chunkSize == 0) {
+                loadCitiesMapped(input, &trie, kept);
+                rowCount = kept.size();
+            } else {
+                rowCount = streamThroughPipe(input, trie, kept, chunkSize);
+            }
+            double loadMs = duration<double, milli>(high_resolution_clock::now() - start).count();
+            long long peakDelta = static_cast<long long>(peakRssBytes()) - static_cast<long long>(rssBefore);
+            size_t mismatches = 0;
+            for (const CityRow& row : rows) {
+                mismatches += trie.search(row.city, row.country) < 0;
+            }
+            cout << "x" << copies << "," << (chunkSize == 0 ? "mmap" : "stream") << "," << chunkSize << "," << rowCount << ","
+                 << fixed << setprecision(3) << loadMs << "," << peakDelta << "," << trie.memoryUsage() << "," << mismatches << "\n";
+        }
+        if (copies != 1) {
+            remove(input.c_str());
+        }
+    }
+    return 0;
+}
+
+int benchmarkColumnarTable(const vector<CityRow>& rows) {
+    // The same rows as a vector of CityRow and as a CityTable, each built from scratch.
+    size_t rssBefore = currentRssBytes();
+    vector<CityRow> copied(rows.begin(), rows.end());
+    long long rowsRss = static_cast<long long>(currentRssBytes()) - static_cast<long long>(rssBefore);
+    size_t rowsBytes = copied.capacity() * sizeof(CityRow);
+    for (const CityRow& row : copied) {
+        for (const string* text : {&row.city, &row.country}) {
+            rowsBytes += text->capacity() > string().capacity() ? text->capacity() + 1 : 0;
+        }
+    }
+    rssBefore = currentRssBytes();
+    CityTable table;
+    for (const CityRow& row : rows) {
+        table.add(row.city, row.country, row.population);
+    }
+    long long tableRss = static_cast<long long>(currentRssBytes()) - static_cast<long long>(rssBefore);
+    cout << "Storage,Rows,Bytes,BytesPerRow,RssDeltaBytes\n";
+    cout << fixed << setprecision(1) << "rows," << rows.size() << "," << rowsBytes << "," << static_cast<double>(rowsBytes) / rows.size()
+         << "," << rowsRss << "\n";
+    cout << "table," << table.size() << "," << table.memoryUsage() << "," << static_cast<double>(table.memoryUsage()) / table.size()
+         << "," << tableRss << "\n";
+
+    // The driver's query set: 250 sampled cities repeated out to 750 lookups.
+    const size_t sampleSize = 250, numQueries = 750, rounds = 200;
+    cout << "QueryGen,Rounds,UsPerRound\n";
+    auto start = high_resolution_clock::now();
+    for (size_t r = 0; r < rounds; ++r) {
+        mt19937 rng(static_cast<unsigned>(r));
+        vector<pair<string, string>> queries;
+        for (size_t i = 0; i < sampleSize; ++i) {
+            const CityRow& row = copied[rng() % copied.size()];
+            queries.emplace_back(row.city, row.country);
+        }
+        while (queries.size() < numQueries) {
+            queries.push_back(queries[rng() % queries.size()]);
+        }
+        benchmarkSink = queries.back().first.size();
+    }
+    cout << "pairs," << rounds << "," << setprecision(3) << duration<double, micro>(high_resolution_clock::now() - start).count() / rounds << "\n";
+    vector<uint32_t> ids;
+    start = high_resolution_clock::now();
+    for (size_t r = 0; r < rounds; ++r) {
+        mt19937 rng(static_cast<unsigned>(r));
+        ids.clear();
+        for (size_t i = 0; i < sampleSize; ++i) {
+            ids.push_back(static_cast<uint32_t>(rng() % table.size()));
+        }
+        while (ids.size() < numQueries) {
+            ids.push_back(ids[rng() % ids.size()]);
+        }
+        benchmarkSink = ids.back();
     }
+    cout << "ids," << rounds << "," << duration<double, micro>(high_resolution_clock::now() - start).count() / rounds << "\n";
 
-    void insert(const string& cityName, const string& countryCode, double population) {
-        TrieNode* node = root;
-        string lowerCity = toLower(cityName);
-        for (char c : lowerCity) {
-            if (node->children.find(c) == node->children.end()) {
-                node->children[c] = new TrieNode();
+    // Every lookup misses and inserts, as on the driver's cold path.
+    cout << "Cache,Puts,NsPerPut\n";
+    for (const string& type : {string("LFU"), string("FIFO"), string("Random")}) {
+        Cache* cache = type == "LFU" ? static_cast<Cache*>(new LFUCache(10))
+                     : type == "FIFO" ? static_cast<Cache*>(new FIFOCache(10))
+                     : static_cast<Cache*>(new RandomCache(10));
+        size_t puts = 0;
+        start = high_resolution_clock::now();
+        for (size_t r = 0; r < 20; ++r) {
+            for (uint32_t id : ids) {
+                cache->put(FoldedText(table.country(id), '|', table.city(id)).view(), id, table.population(id));
+                ++puts;
             }
-            node = node->children[c];
         }
-        node->isEndOfWord = true;
-        string lowerCountry = toLower(countryCode);
-        node->countryPopulation[lowerCountry] = population;
+        cout << type << "," << puts << "," << duration<double, nano>(high_resolution_clock::now() - start).count() / puts << "\n";
+        delete cache;
     }
+    return 0;
+}
 
-    double search(const string& cityName, const string& countryCode) {
-        TrieNode* node = root;
-        string lowerCity = toLower(cityName);
-        string lowerCountry = toLower(countryCode);
-        for (char c : lowerCity) {
-            if (node->children.find(c) == node->children.end()) {
-                return -1.0;
-            }
-            node = node->children[c];
-        }
-        if (!node->isEndOfWord) {
-            return -1.0;
+int benchmarkParallelLoad(const string& csvFile) {
+    const string inflated = writeInflatedCsv(csvFile, 10);
+    CityTable reference;
+    loadCitiesMapped(inflated, nullptr, reference);
+
+    cout << "HardwareThreads," << thread::hardware_concurrency() << "\n";
+    cout << "Threads,Rows,LoadMs,RowsPerSec,Speedup,Mismatches\n";
+    double baseline = 0;
+    for (unsigned threads : {1u, 2u, 4u, 8u, 16u}) {
+        CityTable loaded;
+        auto start = high_resolution_clock::now();
+        loadCitiesParallel(inflated, nullptr, loaded, threads);
+        double loadMs = duration<double, milli>(high_resolution_clock::now() - start).count();
+        if (threads == 1) {
+            baseline = loadMs;
         }
-        auto it = node->countryPopulation.find(lowerCountry);
-        if (it == node->countryPopulation.end()) {
-            return -1.0;
+        size_t mismatches = loaded.size() != reference.size();
+        for (uint32_t i = 0; !mismatches && i < loaded.size(); ++i) {
+            mismatches += loaded.row(i) != reference.row(i);
         }
-        return it->second;
+        cout << threads << "," << loaded.size() << "," << fixed << setprecision(3) << loadMs << "," << setprecision(0)
+             << loaded.size() / (loadMs / 1000) << "," << setprecision(2) << baseline / loadMs << "," << mismatches << "\n";
     }
-};
+    remove(inflated.c_str());
+    return 0;
+}
 
-struct CacheEntry {
-    string key;
-    string city;
-    string country;
-    double population;
-};
+int benchmarkArena(const vector<CityRow>& rows) {
+    vector<pair<string, string>> hits;
+    for (const CityRow& row : rows) {
+        hits.emplace_back(row.city, row.country);
+    }
+    shuffle(hits.begin(), hits.end(), mt19937{47});
+    vector<pair<string, string>> misses = makeMissQueries(rows, rows.size());
 
-class Cache {
-public:
-    virtual ~Cache() = default;
-    virtual bool get(const string &key, double &population) = 0;
-    virtual void put(const string &key, const string &city, const string &country, double population) = 0;
-    virtual void printCache() const = 0;
-};
+    // The arena run goes first: its large blocks go straight back to the OS on teardown,
+    // while the per-node run would leave freed heap behind for the next run to reuse.
+    cout << "Allocator,BuildMs,RssDeltaBytes,HitNs,MissNs,TeardownMs\n";
+    for (bool useArena : {true, false}) {
+        size_t rssBefore = currentRssBytes();
+        auto start = high_resolution_clock::now();
+        NameTrie* trie = new NameTrie(useArena);
+        for (const CityRow& row : rows) {
+            trie->insert(row.city, row.country, row.population);
+        }
+        double buildMs = duration<double, milli>(high_resolution_clock::now() - start).count();
+        long long rssDelta = static_cast<long long>(currentRssBytes()) - static_cast<long long>(rssBefore);
+        double hitNs = averageSearchNanos(*trie, hits);
+        double missNs = averageSearchNanos(*trie, misses);
+        start = high_resolution_clock::now();
+        delete trie;
+        double teardownMs = duration<double, milli>(high_resolution_clock::now() - start).count();
+        cout << (useArena ? "arena" : "new") << "," << fixed << setprecision(3) << buildMs << "," << rssDelta << ","
+             << hitNs << "," << missNs << "," << teardownMs << "\n";
+    }
+    return 0;
+}
 
-class LFUCache : public Cache {
-private:
-    struct Node {
-        string key;
-        string city;
-        string country;
-        double population;
-        int freq;
-        list<string>::iterator freq_it;
-    };
+int benchmarkParallelBuild(const vector<CityRow>& rows) {
+    NameTrie reference;
+    CityTable table;
+    for (const CityRow& row : rows) {
+        reference.insert(row.city, row.country, row.population);
+        table.add(row.city, row.country, row.population);
+    }
+    vector<pair<string, string>> hits;
+    for (const CityRow& row : rows) {
+        hits.emplace_back(row.city, row.country);
+    }
 
-    int capacity;
-    int min_freq;
-    unordered_map<string, Node> key_map;
-    unordered_map<int, list<string>> freq_map;
+    cout << "HardwareThreads," << thread::hardware_concurrency() << "\n";
+    cout << "Threads,BuildMs,Speedup,Mismatches\n";
+    double baseline = 0;
+    for (unsigned threads : {1u, 2u, 4u, 8u, 16u}) {
+        auto start = high_resolution_clock::now();
+        NameTrie trie(table);
+        trie.indexRows(threads);
+        double buildMs = duration<double, milli>(high_resolution_clock::now() - start).count();
+        if (threads == 1) {
+            baseline = buildMs;
+        }
+        size_t mismatches = 0;
+        for (const auto& q : hits) {
+            mismatches += trie.search(q.first, q.second) != reference.search(q.first, q.second);
+        }
+        for (const char* prefix : {"", "a", "sa", "ber"}) {
+            vector<CityRow> expected = reference.complete(prefix, NameTrie::maxCompletions);
+            vector<CityRow> actual = trie.complete(prefix, NameTrie::maxCompletions);
+            bool same = expected.size() == actual.size();
+            for (size_t i = 0; same && i < actual.size(); ++i) {
+                same = expected[i].population == actual[i].population;
+            }
+            mismatches += !same;
+        }
+        cout << threads << "," << fixed << setprecision(3) << buildMs << "," << baseline / buildMs << "," << mismatches << "\n";
+    }
+    return 0;
+}
 
-public:
-    LFUCache(int cap) : capacity(cap), min_freq(0) {}
+int benchmarkBatchSearch(const vector<CityRow>& rows) {
+    vector<pair<string, string>> pairs;
+    for (const CityRow& row : rows) {
+        pairs.emplace_back(row.city, row.country);
+    }
+    vector<pair<string, string>> misses = makeMissQueries(rows, rows.size() / 4);
+    pairs.insert(pairs.end(), misses.begin(), misses.end());
+    shuffle(pairs.begin(), pairs.end(), mt19937{48});
+    vector<CityQuery> queries;
+    for (const auto& q : pairs) {
+        queries.push_back({q.first, q.second});
+    }
 
-    bool get(const string &key, double &population) override {
-        auto it = key_map.find(key);
-        if (it == key_map.end()) {
-            return false;
+    cout << "Index,Queries,LoopMqps,BatchMqps,Speedup,Mismatches\n";
+    for (const string& type : {string("trie"), string("flat")}) {
+        CityIndex* index = createIndex(type);
+        for (const CityRow& row : rows) {
+            index->insert(row.city, row.country, row.population);
         }
+        index->finalize();
 
-        Node &node = it->second;
-        int old_freq = node.freq;
-        node.freq++;
-        population = node.population;
-
-        freq_map[old_freq].erase(node.freq_it);
-        if (freq_map[old_freq].empty()) {
-            freq_map.erase(old_freq);
-            if (old_freq == min_freq) {
-                min_freq++;
-            }
+        vector<double> looped(queries.size()), batched(queries.size());
+        auto start = high_resolution_clock::now();
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            looped[i] = index->search(pairs[i].first, pairs[i].second);
         }
+        double loopSeconds = duration<double>(high_resolution_clock::now() - start).count();
+        start = high_resolution_clock::now();
+        index->searchMany(queries, batched);
+        double batchSeconds = duration<double>(high_resolution_clock::now() - start).count();
 
-        freq_map[node.freq].push_front(key);
-        node.freq_it = freq_map[node.freq].begin();
-        return true;
+        size_t mismatches = 0;
+        for (size_t i = 0; i < queries.size(); ++i) {
+            mismatches += looped[i] != batched[i];
+        }
+        cout << type << "," << queries.size() << "," << fixed << setprecision(3)
+             << queries.size() / loopSeconds / 1e6 << "," << queries.size() / batchSeconds / 1e6 << ","
+             << loopSeconds / batchSeconds << "," << mismatches << "\n";
+        delete index;
     }
+    return 0;
+}
 
-    void put(const string &key, const string &city, const string &country, double population) override {
-        if (capacity <= 0) return;
+int benchmarkChildDispatch(const vector<CityRow>& rows) {
+    mt19937 rng(49);
+    cout << "FanOut,AdaptiveNs,UnorderedMapNs\n";
+    for (int fanOut : {1, 2, 4, 8, 16, 32, 48, 64, 128, 256}) {
+        pmr::monotonic_buffer_resource arena;
+        vector<unsigned char> keys(256);
+        iota(keys.begin(), keys.end(), 0);
+        shuffle(keys.begin(), keys.end(), rng);
+        keys.resize(fanOut);
 
-        auto it = key_map.find(key);
-        if (it != key_map.end()) {
-            Node &node = it->second;
-            node.population = population;
-            node.city = city;
-            node.country = country;
-            double dummy;
-            get(key, dummy);
-            return;
+        TrieChildren adaptive(&arena);
+        pmr::unordered_map<char, TrieNode*> hashed(&arena);
+        for (int i = 0; i < fanOut; ++i) {
+            TrieNode* marker = reinterpret_cast<TrieNode*>(static_cast<uintptr_t>(8 * (i + 1)));
+            adaptive.set(static_cast<char>(keys[i]), marker);
+            hashed[static_cast<char>(keys[i])] = marker;
+        }
+        vector<char> probes(1 << 20);
+        for (char& probe : probes) {
+            probe = static_cast<char>(keys[rng() % fanOut]);
         }
 
-        if (key_map.size() >= capacity) {
-            string evict_key = freq_map[min_freq].back();
-            freq_map[min_freq].pop_back();
-            key_map.erase(evict_key);
-
-            if (freq_map[min_freq].empty()) {
-                freq_map.erase(min_freq);
-            }
+        uintptr_t checksum = 0;
+        auto start = high_resolution_clock::now();
+        for (char probe : probes) {
+            checksum += reinterpret_cast<uintptr_t>(adaptive.find(probe));
+        }
+        double adaptiveNs = duration<double, nano>(high_resolution_clock::now() - start).count() / probes.size();
+        start = high_resolution_clock::now();
+        for (char probe : probes) {
+            auto it = hashed.find(probe);
+            checksum -= reinterpret_cast<uintptr_t>(it->second);
         }
+        double hashedNs = duration<double, nano>(high_resolution_clock::now() - start).count() / probes.size();
+        benchmarkSink = static_cast<double>(checksum);
+        cout << fanOut << "," << fixed << setprecision(2) << adaptiveNs << "," << hashedNs << "\n";
+    }
 
-        min_freq = 1;
-        freq_map[min_freq].push_front(key);
-        key_map[key] = {key, city, country, population, 1, freq_map[min_freq].begin()};
+    NameTrie trie;
+    size_t characters = 0;
+    vector<pair<string, string>> hits;
+    for (const CityRow& row : rows) {
+        trie.insert(row.city, row.country, row.population);
+        hits.emplace_back(row.city, row.country);
+        characters += row.city.size();
     }
+    shuffle(hits.begin(), hits.end(), rng);
+    double hitNs = averageSearchNanos(trie, hits);
+    cout << "TrieHitNs," << fixed << setprecision(2) << hitNs << ",NsPerCharacter," << hitNs * rows.size() / characters << "\n";
+    return 0;
+}
 
-    void printCache() const override {
-        cout << "\n--------- Current LFU Cache ---------\n";
-        for (const auto &pair : key_map) {
-            const Node &node = pair.second;
-            cout << "City: " << node.city << ", Country: " << node.country << ", Population: " << node.population << ", Freq: " << node.freq << "\n";
+// Case-folding throughput over the city names, folded one name at a time as the index
+// paths do and as one concatenated buffer. The scalar column is the byte-wise ::tolower
+// loop foldCase replaced, which leaves non-ASCII text unfolded. The names are views into
+// the concatenated buffer, so the per-name rows measure the cost of each call rather than
+// misses on strings scattered over the heap.
+int benchmarkCaseFold(const vector<CityRow>& rows) {
+    string corpus;
+    size_t nonAscii = 0;
+    for (const CityRow& row : rows) {
+        corpus += row.city;
+        nonAscii += any_of(row.city.begin(), row.city.end(), [](char c) { return static_cast<unsigned char>(c) >= 0x80; });
+    }
+    vector<string_view> names;
+    names.reserve(rows.size());
+    for (size_t offset = 0; const CityRow& row : rows) {
+        names.push_back(string_view(corpus).substr(offset, row.city.size()));
+        offset += row.city.size();
+    }
+    cout << "Names," << rows.size() << ",NonAsciiNames," << nonAscii << "\n";
+    cout << "Input,Bytes,ScalarMBps,FoldMBps\n";
+    size_t passes = max<size_t>(1, (64u << 20) / max<size_t>(1, corpus.size()));
+    vector<char> out(maxFoldedSize(corpus.size()));
+
+    auto throughput = [&](auto&& fold) {
+        size_t checksum = 0;
+        auto start = high_resolution_clock::now();
+        for (size_t pass = 0; pass < passes; ++pass) {
+            checksum += fold();
         }
-        cout << "-------------------------------------\n";
+        double seconds = duration<double>(high_resolution_clock::now() - start).count();
+        benchmarkSink = static_cast<double>(checksum);
+        return passes * corpus.size() / seconds / 1e6;
+    };
+    auto scalarNames = [&]() {
+        size_t total = 0;
+        for (string_view name : names) {
+            total += transform(name.begin(), name.end(), out.begin(),
+                               [](char c) { return static_cast<char>(::tolower(static_cast<unsigned char>(c))); }) - out.begin();
+        }
+        return total;
+    };
+    auto foldNames = [&]() {
+        size_t total = 0;
+        for (string_view name : names) {
+            total += foldCase(name, out.data());
+        }
+        return total;
+    };
+    auto scalarCorpus = [&]() {
+        return static_cast<size_t>(transform(corpus.begin(), corpus.end(), out.begin(),
+                                             [](char c) { return static_cast<char>(::tolower(static_cast<unsigned char>(c))); }) - out.begin());
+    };
+    auto foldCorpus = [&]() {
+        return foldCase(corpus, out.data());
+    };
+    cout << fixed << setprecision(1);
+    cout << "PerName," << corpus.size() << "," << throughput(scalarNames) << "," << throughput(foldNames) << "\n";
+    cout << "Corpus," << corpus.size() << "," << throughput(scalarCorpus) << "," << throughput(foldCorpus) << "\n";
+    return 0;
+}
+
+// Read throughput of searches racing one writer that changes populations (and adds a city
+// every tenth update) at 1% of the read rate: a NameTrie behind a mutex against a
+// LiveNameTrie whose readers take no locks.
+int benchmarkLiveUpdates(const vector<CityRow>& rows) {
+    vector<pair<string, string>> hits;
+    for (const CityRow& row : rows) {
+        hits.emplace_back(row.city, row.country);
     }
-};
+    shuffle(hits.begin(), hits.end(), mt19937{51});
+    const auto runFor = milliseconds(400);
+    const size_t publishEvery = 16;
 
-class FIFOCache : public Cache {
-private:
-    list<CacheEntry> entries;
-    unordered_map<string, list<CacheEntry>::iterator> cacheMap;
-    int capacity;
+    cout << "HardwareThreads," << thread::hardware_concurrency() << "\n";
+    cout << "Readers,Mode,ReadMqps,Updates,UpdatePercent,Mismatches\n";
+    for (unsigned readers : {1u, 2u, 4u, 8u}) {
+        for (const string mode : {"mutex", "rcu"}) {
+            NameTrie locked;
+            LiveNameTrie live;
+            mutex lock;
+            for (const CityRow& row : rows) {
+                if (mode == "mutex") {
+                    locked.insert(row.city, row.country, row.population);
+                } else {
+                    live.insert(row.city, row.country, row.population);
+                }
+            }
+            live.publish();
 
-public:
-    FIFOCache(int cap) : capacity(cap) {}
+            atomic<bool> stop{false};
+            atomic<size_t> reads{0};
+            vector<CityRow> updates;
+            auto search = [&](const pair<string, string>& q) {
+                if (mode == "mutex") {
+                    lock_guard<mutex> held(lock);
+                    return locked.search(q.first, q.second);
+                }
+                return live.search(q.first, q.second);
+            };
+            vector<thread> threads;
+            vector<double> checksums(readers);
+            for (unsigned r = 0; r < readers; ++r) {
+                threads.emplace_back([&, r]() {
+                    double& checksum = checksums[r];
+                    size_t i = r * hits.size() / readers;
+                    size_t done = 0;
+                    while (!stop.load(memory_order_relaxed)) {
+                        checksum += search(hits[i]);
+                        i = i + 1 == hits.size() ? 0 : i + 1;
+                        if (++done == 256) {
+                            reads.fetch_add(done, memory_order_relaxed);
+                            done = 0;
+                        }
+                    }
+                    reads.fetch_add(done, memory_order_relaxed);
+                });
+            }
+            // The writer applies publishEvery updates, then publishes, for every
+            // 100 * publishEvery reads, in both modes.
+            threads.emplace_back([&]() {
+                mt19937 rng(52);
+                while (!stop.load(memory_order_relaxed)) {
+                    if ((updates.size() + publishEvery) * 100 > reads.load(memory_order_relaxed)) {
+                        this_thread::yield();
+                        continue;
+                    }
+                    for (size_t b = 0; b < publishEvery; ++b) {
+                        CityRow row = rows[rng() % rows.size()];
+                        if (updates.size() % 10 == 9) {
+                            row.city += " " + to_string(updates.size());
+                        }
+                        row.population = rng() % 10000000;
+                        updates.push_back(row);
+                        if (mode == "mutex") {
+                            lock_guard<mutex> held(lock);
+                            locked.insert(row.city, row.country, row.population);
+                        } else {
+                            live.insert(row.city, row.country, row.population);
+                        }
+                    }
+                    if (mode == "rcu") {
+                        live.publish();
+                    }
+                }
+            });
+            auto start = high_resolution_clock::now();
+            this_thread::sleep_for(runFor);
+            stop = true;
+            for (thread& t : threads) {
+                t.join();
+            }
+            double seconds = duration<double>(high_resolution_clock::now() - start).count();
+            benchmarkSink = accumulate(checksums.begin(), checksums.end(), 0.0);
+            live.publish();
 
-    bool get(const string &key, double &population) override {
-        auto it = cacheMap.find(key);
-        if (it == cacheMap.end()) {
-            return false;
+            NameTrie reference;
+            for (const CityRow& row : rows) {
+                reference.insert(row.city, row.country, row.population);
+            }
+            for (const CityRow& row : updates) {
+                reference.insert(row.city, row.country, row.population);
+            }
+            CityIndex& index = mode == "mutex" ? static_cast<CityIndex&>(locked) : live;
+            size_t mismatches = 0;
+            for (const CityRow& row : rows) {
+                mismatches += index.search(row.city, row.country) != reference.search(row.city, row.country);
+            }
+            for (const CityRow& row : updates) {
+                mismatches += index.search(row.city, row.country) != reference.search(row.city, row.country);
+            }
+            // A writer that fell more than 5% short of 1% updates was not keeping up, so its
+            // read rate would not be comparable and is left out.
+            bool onTarget = updates.size() * 100 * 100 >= reads.load() * 95;
+            cout << readers << "," << mode << ",";
+            if (onTarget) {
+                cout << fixed << setprecision(3) << reads.load() / seconds / 1e6;
+            } else {
+                cout << "missed";
+            }
+            cout << "," << updates.size() << "," << fixed << setprecision(3) << 100.0 * updates.size() / max<size_t>(1, reads.load())
+                 << "," << mismatches << "\n";
         }
-        population = it->second->population;
-        return true;
     }
 
-    void put(const string &key, const string &city, const string &country, double population) override {
-        auto it = cacheMap.find(key);
-        if (it != cacheMap.end()) {
-            it->second->population = population;
-            return;
+    // A reader that cached keys before an update must not be served the old population.
+    LiveNameTrie live;
+    for (const CityRow& row : rows) {
+        live.insert(row.city, row.country, row.population);
+    }
+    live.publish();
+    LFUCache cache(10);
+    uint64_t seen = 0;
+    // Seeded with the published values: a row whose key repeats later in the file does not
+    // hold the population the trie serves, and would count as stale on its own.
+    for (size_t i = 0; i < 10 && i < rows.size(); ++i) {
+        cache.put(FoldedText(rows[i].country, '|', rows[i].city).view(), static_cast<uint32_t>(i), live.search(rows[i].city, rows[i].country));
+    }
+    for (size_t i = 0; i < 10 && i < rows.size(); i += 2) {
+        live.insert(rows[i].city, rows[i].country, live.search(rows[i].city, rows[i].country) + 1);
+        live.publish();
+    }
+    live.invalidate(cache, seen);
+    size_t stale = 0;
+    for (size_t i = 0; i < 10 && i < rows.size(); ++i) {
+        double population;
+        if (cache.get(FoldedText(rows[i].country, '|', rows[i].city).view(), population)) {
+            stale += population != live.search(rows[i].city, rows[i].country);
         }
+    }
+    cout << "StaleCacheHits," << stale << "\n";
+    return 0;
+}
 
-        if (entries.size() >= capacity) {
-            CacheEntry oldest = entries.front();
-            cacheMap.erase(oldest.key);
-            entries.pop_front();
-        }
+#ifdef CS210_COUNT_ALLOCATIONS
+// Counts global operator new calls on the current thread, for benchmarkAllocations. Only
+// builds configured with CS210_COUNT_ALLOCATIONS replace operator new, so ordinary runs
+// allocate through the library's own.
+thread_local size_t heapAllocations = 0;
 
-        entries.push_back({key, city, country, population});
-        cacheMap[key] = --entries.end();
+void* operator new(size_t size) {
+    ++heapAllocations;
+    if (void* memory = malloc(size ? size : 1)) {
+        return memory;
     }
+    throw bad_alloc();
+}
 
-    void printCache() const override {
-        cout << "\n--------- Current FIFO Cache ---------\n";
-        for (const CacheEntry &entry : entries) {
-            cout << "City: " << entry.city << ", Country: " << entry.country << ", Population: " << entry.population << "\n";
-        }
-        cout << "--------------------------------------\n";
-    }
-};
+// The nothrow and array forms are replaced too, so that every operator delete below is paired
+// with a malloc-based allocation; std::stable_sort takes its buffer with nothrow new.
+void* operator new(size_t size, const nothrow_t&) noexcept {
+    ++heapAllocations;
+    return malloc(size ? size : 1);
+}
 
-class RandomCache : public Cache {
-private:
-    vector<CacheEntry> entries;
-    unordered_map<string, size_t> keyMap;
-    int capacity;
+void* operator new[](size_t size) {
+    return operator new(size);
+}
 
-public:
-    RandomCache(int cap) : capacity(cap) { srand(time(0)); }
+void* operator new[](size_t size, const nothrow_t& tag) noexcept {
+    return operator new(size, tag);
+}
 
-    bool get(const string &key, double &population) override {
-        auto it = keyMap.find(key);
-        if (it == keyMap.end())
-            return false;
-        population = entries[it->second].population;
-        return true;
-    }
+// GCC flags free() on memory from operator new once these are inlined, but the replacement
+// operator new above is malloc-based, so the pairing is correct.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* memory) noexcept {
+    free(memory);
+}
 
-    void put(const string &key, const string &city, const string &country, double population) override {
-        auto it = keyMap.find(key);
-        if (it != keyMap.end()) {
-            entries[it->second] = {key, city, country, population};
-            return;
-        }
+void operator delete(void* memory, size_t) noexcept {
+    free(memory);
+}
 
-        if (entries.size() >= capacity) {
-            int index = rand() % entries.size();
-            string evictKey = entries[index].key;
+void operator delete[](void* memory) noexcept {
+    free(memory);
+}
 
-            if (index != entries.size() - 1) {
-                entries[index] = entries.back();
-                keyMap[entries[index].key] = index;
-            }
+void operator delete[](void* memory, size_t) noexcept {
+    free(memory);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
 
-            entries.pop_back();
-            keyMap.erase(evictKey);
+// Allocations per query on the lookup path. Key construction, every index's search and
+// the FIFO and Random caches' get must not allocate at all; a stage that does is reported
+// and fails the run. LFU's get moves entries between frequency lists and is only reported.
+int benchmarkAllocations(const vector<CityRow>& rows) {
+    vector<pair<string, string>> queries;
+    for (size_t i = 0; i < rows.size() && i < 20000; ++i) {
+        queries.emplace_back(rows[i].city, rows[i].country);
+    }
+    vector<pair<string, string>> misses = makeMissQueries(rows, 5000);
+    queries.insert(queries.end(), misses.begin(), misses.end());
+
+    size_t failures = 0;
+    auto report = [&](const string& stage, size_t count, size_t allocations, bool mustBeZero) {
+        cout << stage << "," << count << "," << fixed << setprecision(4) << static_cast<double>(allocations) / count << "\n";
+        if (mustBeZero && allocations > 0) {
+            cerr << stage << " made " << allocations << " heap allocations over " << count << " queries" << endl;
+            ++failures;
         }
+    };
 
-        entries.push_back({key, city, country, population});
-        keyMap[key] = entries.size() - 1;
+    cout << "Stage,Queries,AllocationsPerQuery\n";
+    size_t before = heapAllocations;
+    size_t length = 0;
+    for (const auto& q : queries) {
+        FoldedText key(q.second, '|', q.first);
+        length += key.view().size();
     }
+    benchmarkSink = static_cast<double>(length);
+    report("CacheKey", queries.size(), heapAllocations - before, true);
 
-    void printCache() const override {
-        cout << "\n------- Current Random Cache --------\n";
-        for (const CacheEntry &entry : entries) {
-            cout << "City: " << entry.city << ", Country: " << entry.country
-                 << ", Population: " << entry.population << "\n";
+    for (const string& type : {string("trie"), string("flat"), string("radix"), string("mphf")}) {
+        CityIndex* index = createIndex(type);
+        for (const CityRow& row : rows) {
+            index->insert(row.city, row.country, row.population);
         }
-        cout << "-------------------------------------\n";
+        index->finalize();
+        before = heapAllocations;
+        double checksum = 0;
+        for (const auto& q : queries) {
+            checksum += index->search(q.first, q.second);
+        }
+        benchmarkSink = checksum;
+        report(type + "Search", queries.size(), heapAllocations - before, true);
+        delete index;
     }
-};
 
-int main() {
-    const string csvFile = "C:\\Users\\maddi\\Downloads\\world_cities.csv";
-    NameTrie trie;
+    // Warm each cache with the first entries, then replay a hit-heavy stream of gets.
+    for (const string& type : {string("LFU"), string("FIFO"), string("Random")}) {
+        Cache* cache = type == "LFU" ? static_cast<Cache*>(new LFUCache(10))
+                     : type == "FIFO" ? static_cast<Cache*>(new FIFOCache(10))
+                     : static_cast<Cache*>(new RandomCache(10));
+        for (size_t i = 0; i < 10; ++i) {
+            cache->put(FoldedText(queries[i].second, '|', queries[i].first).view(), static_cast<uint32_t>(i), 1.0);
+        }
+        mt19937 rng(50);
+        size_t gets = 100000;
+        before = heapAllocations;
+        double population = 0;
+        for (size_t i = 0; i < gets; ++i) {
+            const auto& q = queries[rng() % 20];
+            FoldedText key(q.second, '|', q.first);
+            cache->get(key.view(), population);
+        }
+        report(type + "Get", gets, heapAllocations - before, type != "LFU");
+        delete cache;
+    }
+    return failures ? 1 : 0;
+}
+#endif
 
-    ifstream file(csvFile);
-    if (!file.is_open()) {
-        cerr << "Error opening file " << csvFile << endl;
+void printTrieStats(const TrieStats& stats) {
+    cout << "Nodes," << stats.nodes << "\n";
+    cout << "Terminals," << stats.terminals << "\n";
+    cout << "Cities," << stats.cities << "\n";
+    cout << "NodeBytes," << stats.nodeBytes << "\n";
+    cout << "TotalBytes," << stats.totalBytes << "\n";
+    cout << "BytesPerCity," << fixed << setprecision(1) << stats.bytesPerCity() << "\n";
+    cout << "FanOut,Nodes\n";
+    for (size_t k = 0; k < stats.fanOut.size(); ++k) {
+        if (stats.fanOut[k]) {
+            cout << k << "," << stats.fanOut[k] << "\n";
+        }
+    }
+    cout << "Depth,Nodes\n";
+    for (size_t d = 0; d < stats.depth.size(); ++d) {
+        cout << d << "," << stats.depth[d] << "\n";
+    }
+}
+
+int runBenchmark(const string& name, const vector<CityRow>& rows, const string& csvFile) {
+    if (name == "flat") {
+        return benchmarkIndexes(rows, {"trie", "flat"});
+    } else if (name == "radix") {
+        return benchmarkIndexes(rows, {"trie", "radix"});
+    } else if (name == "mphf") {
+        return benchmarkIndexes(rows, {"trie", "flat", "mphf"});
+    } else if (name == "louds") {
+        return benchmarkLouds(rows);
+    } else if (name == "dawg") {
+        return benchmarkDawg(rows);
+    } else if (name == "complete") {
+        return benchmarkCompletion(rows);
+    } else if (name == "fuzzy") {
+        return benchmarkFuzzy(rows);
+    } else if (name == "snapshot") {
+        return benchmarkSnapshot(rows, csvFile);
+    } else if (name == "arena") {
+        return benchmarkArena(rows);
+    } else if (name == "parallel") {
+        return benchmarkParallelBuild(rows);
+    } else if (name == "batch") {
+        return benchmarkBatchSearch(rows);
+    } else if (name == "children") {
+        return benchmarkChildDispatch(rows);
+    } else if (name == "allocations") {
+#ifdef CS210_COUNT_ALLOCATIONS
+        return benchmarkAllocations(rows);
+#else
+        cerr << "--bench allocations needs a build configured with -DCS210_COUNT_ALLOCATIONS=ON" << endl;
         return 1;
+#endif
+    } else if (name == "casefold") {
+        return benchmarkCaseFold(rows);
+    } else if (name == "live") {
+        return benchmarkLiveUpdates(rows);
+    } else if (name == "countries") {
+        return benchmarkCountryIndex(rows);
+    } else if (name == "population") {
+        return benchmarkPopulationIndex(rows);
+    } else if (name == "delta") {
+        return benchmarkDelta(rows, csvFile);
+    } else if (name == "load") {
+        return benchmarkLoad(csvFile);
+    } else if (name == "parallel-load") {
+        return benchmarkParallelLoad(csvFile);
+    } else if (name == "quoted") {
+        return benchmarkQuotedLoad(rows, csvFile);
+    } else if (name == "stream") {
+        return benchmarkStreamLoad(rows, csvFile);
+    } else if (name == "columnar") {
+        return benchmarkColumnarTable(rows);
     }
+    cerr << "Unknown benchmark " << name << endl;
+    return 1;
+}
 
-    vector<pair<string, string>> allCities;
-    string line;
-    getline(file, line);
+int main(int argc, char* argv[]) {
+    string csvFile = "C:\\Users\\maddi\\Downloads\\world_cities.csv";
+    string indexType = "trie";
+    string benchName;
+    int fuzzyDistance = 0;
+    string snapshotFile;
+    string saveSnapshotFile;
+    unsigned buildThreads = 1;
+    bool printStats = false;
+    string deltaFile;
+    bool streamInput = false;
+    const int numQueries = 750;
+    const int sampleSize = 250;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--csv" && i + 1 < argc) {
+            csvFile = argv[++i];
+        } else if (arg == "--index" && i + 1 < argc) {
+            indexType = argv[++i];
+        } else if (arg == "--bench" && i + 1 < argc) {
+            benchName = argv[++i];
+        } else if (arg == "--fuzzy" && i + 1 < argc) {
+            fuzzyDistance = atoi(argv[++i]);
+        } else if (arg == "--snapshot" && i + 1 < argc) {
+            snapshotFile = argv[++i];
+        } else if (arg == "--save-snapshot" && i + 1 < argc) {
+            saveSnapshotFile = argv[++i];
+        } else if (arg == "--threads" && i + 1 < argc) {
+            buildThreads = static_cast<unsigned>(max(1, atoi(argv[++i])));
+        } else if (arg == "--stats") {
+            printStats = true;
+        } else if (arg == "--delta" && i + 1 < argc) {
+            deltaFile = argv[++i];
+        } else if (arg == "--stream") {
+            streamInput = true;
+        } else {
+            cerr << "Usage: " << argv[0] << " [--csv path|-] [--stream] [--index trie|flat|radix|mphf|live|louds|dawg] [--fuzzy distance] [--threads n] [--snapshot path] [--save-snapshot path] [--stats] [--delta path] [--bench flat|radix|mphf|louds|dawg|complete|fuzzy|snapshot|arena|parallel|batch|children|allocations|casefold|live|countries|population|delta|load|parallel-load|quoted|stream|columnar]" << endl;
+            return 1;
+        }
+    }
 
-    while (getline(file, line)) {
-        stringstream ss(line);
-        string countryCode, cityName, populationStr;
-        getline(ss, cityName, ',');
-        getline(ss, countryCode, ',');
-        getline(ss, populationStr, ',');
+    // A NameTrie indexes allCities itself, so the city ids the caches below hold are its
+    // own; the loaders then fill only the table, or only the trie when streaming.
+    CityTable allCities;
+    CityIndex* trie = createIndex(indexType, &allCities);
+    if (!trie) {
+        cerr << "Unknown index type " << indexType << endl;
+        return 1;
+    }
+    NameTrie* tableTrie = dynamic_cast<NameTrie*>(trie);
 
-        try {
-            double population = stod(populationStr);
-            trie.insert(cityName, countryCode, population);
-            allCities.emplace_back(cityName, countryCode);
-        } catch (const exception &e) {
-            cerr << "Error parsing line: " << line << " - " << e.what() << endl;
+    if (!snapshotFile.empty()) {
+        MappedNameTrie* mapped = new MappedNameTrie();
+        if (!mapped->open(snapshotFile)) {
+            delete mapped;
+            delete trie;
+            return 1;
+        }
+        delete trie;
+        trie = mapped;
+        tableTrie = nullptr;
+        // Queries need only a sample; benchmarks and re-saving need every row.
+        if (benchName.empty() && saveSnapshotFile.empty()) {
+            mt19937_64 rng{random_device{}()};
+            mapped->sampleRows(sampleSize, allCities, rng);
+        } else {
+            for (const CityRow& row : mapped->rows()) {
+                allCities.add(row.city, row.country, row.population);
+            }
+        }
+    } else if (streamInput || csvFile == "-") {
+        // Only a sample of the streamed rows is kept, which is enough for the query run; a
+        // NameTrie keeps every row in allCities anyway and needs none.
+        if (!benchName.empty() || !saveSnapshotFile.empty()) {
+            cerr << "--stream cannot be combined with --bench or --save-snapshot" << endl;
+            delete trie;
+            return 1;
+        }
+        size_t rowCount = 0;
+        if (!loadCitiesStream(csvFile, trie, allCities, tableTrie ? 0 : sampleSize, rowCount)) {
+            delete trie;
+            return 1;
+        }
+    } else {
+        CityIndex* target = benchName.empty() && !tableTrie ? trie : nullptr;
+        if (!loadCitiesParallel(csvFile, target, allCities, buildThreads)) {
+            delete trie;
+            return 1;
+        }
+        if (tableTrie && benchName.empty()) {
+            tableTrie->indexRows(buildThreads);
         }
     }
-    file.close();
+    if (!deltaFile.empty() && benchName.empty()) {
+        NameTrie* nameTrie = dynamic_cast<NameTrie*>(trie);
+        if (!nameTrie) {
+            cerr << "--delta needs --index trie" << endl;
+            delete trie;
+            return 1;
+        }
+        DeltaResult applied;
+        auto start = high_resolution_clock::now();
+        if (!applyDelta(deltaFile, *nameTrie, {}, applied)) {
+            delete trie;
+            return 1;
+        }
+        cout << "Applied " << applied.upserts << " upserts and " << applied.deletes << " deletes (" << applied.missing
+             << " not found) in " << fixed << setprecision(3) << duration<double, milli>(high_resolution_clock::now() - start).count()
+             << " ms" << endl;
+    }
+    trie->finalize();
+
+    if (!saveSnapshotFile.empty()) {
+        FlatNameTrie flat;
+        for (uint32_t id = 0; id < allCities.size(); ++id) {
+            flat.insert(allCities.city(id), allCities.country(id), allCities.population(id));
+        }
+        bool saved = flat.saveSnapshot(saveSnapshotFile);
+        delete trie;
+        return saved ? 0 : 1;
+    }
 
     if (allCities.empty()) {
         cerr << "No cities loaded. Exiting!" << endl;
         return 1;
     }
 
-    const int numQueries = 750;
-    const int sampleSize = 250;
-    vector<pair<string, string>> testQueries;
+    if (!benchName.empty()) {
+        delete trie;
+        return runBenchmark(benchName, allCities.rows(), csvFile);
+    }
+
+    if (printStats) {
+        NameTrie* nameTrie = dynamic_cast<NameTrie*>(trie);
+        if (!nameTrie) {
+            cerr << "--stats needs --index trie" << endl;
+            delete trie;
+            return 1;
+        }
+        printTrieStats(nameTrie->stats());
+        delete trie;
+        return 0;
+    }
 
-    shuffle(allCities.begin(), allCities.end(), mt19937{random_device{}()});
-    for (int i = 0; i < sampleSize && i < allCities.size(); i++) {
-        testQueries.push_back(allCities[i]);
+    // Queries are city ids into allCities, skipping rows a delta erased.
+    vector<uint32_t> testQueries;
+    for (uint32_t id = 0; id < allCities.size(); ++id) {
+        if (!tableTrie || !tableTrie->isErased(id)) {
+            testQueries.push_back(id);
+        }
+    }
+    if (testQueries.empty()) {
+        cerr << "No cities loaded. Exiting!" << endl;
+        delete trie;
+        return 1;
     }
+    shuffle(testQueries.begin(), testQueries.end(), mt19937{random_device{}()});
+    testQueries.resize(min<size_t>(sampleSize, testQueries.size()));
 
     while (testQueries.size() < numQueries) {
         testQueries.push_back(testQueries[rand() % testQueries.size()]);
@@ -317,6 +6039,7 @@ int main() {
     ofstream outFile("C:\\Users\\maddi\\Downloads\\load_results.csv");
     outFile << "CacheType,QueryNumber,Country,City,Hit,TimeMicroSeconds\n";
 
+    NameTrie* nameTrie = dynamic_cast<NameTrie*>(trie);
     vector<string> cacheTypes = {"LFU", "FIFO", "Random"};
     for (const string& type : cacheTypes) {
         Cache* cache = nullptr;
@@ -329,18 +6052,25 @@ int main() {
         }
 
         for (int i = 0; i < numQueries; ++i) {
-            string city = testQueries[i].first;
-            string country = testQueries[i].second;
-            string key = toLower(country) + "|" + toLower(city);
+            uint32_t cityId = testQueries[i];
+            string_view city = allCities.city(cityId);
+            string_view country = allCities.country(cityId);
+            FoldedText key(country, '|', city);
             double population;
             bool hit;
 
             auto start = high_resolution_clock::now();
-            hit = cache->get(key, population);
+            hit = cache->get(key.view(), population);
             if (!hit) {
-                population = trie.search(city, country);
+                population = trie->search(city, country);
+                if (population == -1.0 && fuzzyDistance > 0 && nameTrie) {
+                    vector<FuzzyMatch> matches = nameTrie->fuzzySearch(string(city), string(country), fuzzyDistance, 1);
+                    if (!matches.empty()) {
+                        population = matches[0].city.population;
+                    }
+                }
                 if (population != -1.0) {
-                    cache->put(key, city, country, population);
+                    cache->put(key.view(), cityId, population);
                 }
             }
 
@@ -351,5 +6081,6 @@ int main() {
         delete cache;
     }
     outFile.close();
+    delete trie;
     return 0;
 }
\ No newline at end of file